@@ -0,0 +1,191 @@
+#include "addressnormalizer.h"
+
+#include <QSet>
+#include <QVarLengthArray>
+
+#include <algorithm>
+
+using namespace SendGrid;
+
+namespace {
+
+enum CharClass : quint8
+{
+    Atom = 1,   // allowed in the local part
+    Label = 2,  // allowed in a domain label
+    Upper = 4,  // ASCII upper case letter
+    Space = 8,
+    High = 16   // part of a multibyte UTF-8 sequence
+};
+
+struct CharTable
+{
+    quint8 classes[256] = {};
+
+    CharTable()
+    {
+        for(int c = 'a'; c <= 'z'; c++) classes[c] = Atom | Label;
+        for(int c = 'A'; c <= 'Z'; c++) classes[c] = Atom | Label | Upper;
+        for(int c = '0'; c <= '9'; c++) classes[c] = Atom | Label;
+        for(int c = 0x80; c < 0x100; c++) classes[c] = Atom | Label | High;
+
+        for(const char *p = "!#$%&'*+/=?^_`{|}~"; *p; p++) classes[uchar(*p)] = Atom;
+
+        classes[uchar('-')] = Atom | Label;
+
+        for(const char *p = " \t\r\n\f\v"; *p; p++) classes[uchar(*p)] = Space;
+    }
+};
+
+const CharTable table;
+
+const int MaxLocalPart = 64;
+const int MaxDomain = 253;
+const int MaxLabel = 63;
+
+}
+
+bool AddressNormalizer::normalize(QByteArray &address, bool *changed)
+{
+    const quint8 *classes = table.classes;
+
+    const uchar *data = reinterpret_cast<const uchar *>(address.constData());
+    int begin = 0;
+    int end = address.size();
+
+    while(begin < end && (classes[data[begin]] & Space)) begin++;
+    while(end > begin && (classes[data[end - 1]] & Space)) end--;
+
+    // local part, dot separated atoms
+    int i = begin;
+    bool dot = true;
+
+    for(; i < end && data[i] != '@'; i++)
+    {
+        uchar c = data[i];
+
+        if(c == '.') {
+            if(dot) return false;
+            dot = true;
+        }
+        else if(classes[c] & Atom) dot = false;
+        else return false;
+    }
+
+    if(dot || i == end || i - begin > MaxLocalPart) return false;
+
+    int at = i++;
+
+    // domain, at least two labels, hyphens only inside a label
+    int labels = 0;
+    int labelStart = i;
+    bool upper = false;
+
+    if(end - i > MaxDomain) return false;
+
+    for(; i <= end; i++)
+    {
+        if(i == end || data[i] == '.')
+        {
+            int length = i - labelStart;
+
+            if(length == 0 || length > MaxLabel) return false;
+            if(data[labelStart] == '-' || data[i - 1] == '-') return false;
+
+            labels++;
+            labelStart = i + 1;
+            continue;
+        }
+
+        quint8 c = classes[data[i]];
+
+        if(!(c & Label)) return false;
+        upper |= (c & Upper) != 0;
+    }
+
+    if(labels < 2) return false;
+
+    bool rewrite = begin != 0 || end != address.size() || upper;
+
+    if(changed) *changed = rewrite;
+    if(!rewrite) return true;
+
+    address = address.mid(begin, end - begin);
+
+    if(upper)
+    {
+        char *p = address.data();
+
+        for(int j = at - begin + 1; j < address.size(); j++)
+            if(classes[uchar(p[j])] & Upper) p[j] = char(p[j] + ('a' - 'A'));
+    }
+
+    return true;
+}
+
+bool AddressNormalizer::normalize(EmailAddress &address)
+{
+    QByteArray utf8 = address.email.toUtf8();
+    bool changed;
+
+    if(!normalize(utf8, &changed)) return false;
+
+    // untouched addresses keep sharing their data
+    if(changed) address.email = QString::fromUtf8(utf8);
+
+    return true;
+}
+
+int AddressNormalizer::normalize(Personalization &personalization)
+{
+    QList<EmailAddress> *lists[] = {&personalization.to, &personalization.cc, &personalization.bcc};
+
+    int total = 0;
+    for(QList<EmailAddress> *list : lists) total += list->size();
+
+    int removed = 0;
+
+    // the server compares addresses without regard to case
+    QVarLengthArray<QByteArray, 8> seen;
+    QSet<QByteArray> seenSet;
+    bool useSet = total > 8;
+
+    if(useSet) seenSet.reserve(total);
+
+    for(QList<EmailAddress> *list : lists)
+    {
+        for(int i = 0; i < list->size();)
+        {
+            // read through at(), the list is only detached if an address changes
+            QByteArray utf8 = list->at(i).email.toUtf8();
+            bool changed;
+
+            if(!normalize(utf8, &changed)) {
+                list->removeAt(i);
+                removed++;
+                continue;
+            }
+
+            if(changed) (*list)[i].email = QString::fromUtf8(utf8);
+
+            if(total > 1)
+            {
+                QByteArray key = utf8.toLower();
+                bool repeated = useSet ? seenSet.contains(key) : std::find(seen.cbegin(), seen.cend(), key) != seen.cend();
+
+                if(repeated) {
+                    list->removeAt(i);
+                    removed++;
+                    continue;
+                }
+
+                if(useSet) seenSet.insert(key);
+                else seen.append(key);
+            }
+
+            i++;
+        }
+    }
+
+    return removed;
+}
@@ -0,0 +1,32 @@
+#ifndef ADDRESSNORMALIZER_H
+#define ADDRESSNORMALIZER_H
+
+#include "sendgrid.h"
+
+#include <QByteArray>
+
+namespace SendGrid {
+
+// checks and normalizes recipient addresses before they are sent, so a typo or a
+// duplicate doesn't get the whole request rejected. the check is deliberately
+// lighter than RFC 5322: a dot-atom local part, no quoted strings or comments,
+// and a domain of at least two labels. bytes of 0x80 and up are let through on
+// both sides for internationalized addresses
+class AddressNormalizer
+{
+public:
+    // trims whitespace and lowercases the ASCII letters of the domain in place,
+    // returns false if the address is not valid. changed tells if it was rewritten
+    static bool normalize(QByteArray &address, bool *changed = nullptr);
+
+    // the same on an EmailAddress, email is only rewritten if something changed
+    static bool normalize(EmailAddress &address);
+
+    // normalizes to, cc and bcc, dropping invalid addresses and repeats of an
+    // address already seen in the personalization, to is kept over cc over bcc.
+    // returns how many addresses were dropped
+    static int normalize(Personalization &personalization);
+};
+
+}
+#endif // ADDRESSNORMALIZER_H
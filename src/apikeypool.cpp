@@ -0,0 +1,126 @@
+#include "apikeypool.h"
+
+#include <cmath>
+#include <limits>
+
+using namespace SendGrid;
+
+const QNetworkRequest::Attribute ApiKeyPool::KeyAttribute = QNetworkRequest::Attribute(QNetworkRequest::User + 1);
+
+ApiKeyPool::ApiKeyPool()
+{
+    clock.start();
+}
+
+void ApiKeyPool::addKey(QByteArray key, double rate, double weight, QByteArray onBehalfOf)
+{
+    refill();
+
+    rate = qMax(rate, 0.001);
+    keys.append(Key {"Bearer " + key, onBehalfOf, rate, qMax(weight, 0.001), qMax(rate, 1.0)});
+}
+
+bool ApiKeyPool::isEmpty(){
+    return keys.isEmpty();
+}
+
+int ApiKeyPool::count(){
+    return keys.size();
+}
+
+double ApiKeyPool::capacity(const Key &key)
+{
+    // a bucket smaller than one request would never let one through
+    return qMax(key.rate, 1.0);
+}
+
+void ApiKeyPool::refill()
+{
+    qint64 now = clock.elapsed();
+    double seconds = (now - lastRefill) / 1000.0;
+    lastRefill = now;
+
+    for(Key &key : keys)
+        key.tokens = qMin(capacity(key), key.tokens + key.rate * seconds);
+}
+
+int ApiKeyPool::pick()
+{
+    if(keys.isEmpty()) return -1;
+
+    refill();
+
+    // headroom is the share of the bucket left, scaled by weight
+    int best = -1;
+    double bestHeadroom = 0;
+
+    // when every bucket is dry, the key whose next token comes first
+    int soonest = 0;
+    double soonestWait = std::numeric_limits<double>::max();
+
+    for(int i = 0; i < keys.size(); i++)
+    {
+        const Key &key = keys.at(i);
+
+        if(key.tokens < 1)
+        {
+            double wait = (1 - key.tokens) / key.rate;
+
+            if(wait < soonestWait) {
+                soonest = i;
+                soonestWait = wait;
+            }
+
+            continue;
+        }
+
+        double headroom = key.tokens / capacity(key) * key.weight;
+
+        if(best < 0 || headroom > bestHeadroom) {
+            best = i;
+            bestHeadroom = headroom;
+        }
+    }
+
+    return best >= 0 ? best : soonest;
+}
+
+int ApiKeyPool::acquire(int index)
+{
+    if(index < 0 || index >= keys.size()) return 0;
+
+    refill();
+
+    Key &key = keys[index];
+
+    if(key.tokens >= 1) {
+        key.tokens -= 1;
+        return 0;
+    }
+
+    // rounded up, a wait of 0 would mean go
+    return qMax(1, int(std::ceil((1 - key.tokens) / key.rate * 1000)));
+}
+
+void ApiKeyPool::apply(int index, QNetworkRequest &request)
+{
+    if(index < 0 || index >= keys.size()) return;
+
+    const Key &key = keys.at(index);
+
+    request.setRawHeader("Authorization", key.authorization);
+    if(!key.onBehalfOf.isEmpty()) request.setRawHeader("On-Behalf-Of", key.onBehalfOf);
+
+    request.setAttribute(KeyAttribute, index);
+}
+
+void ApiKeyPool::update(int index, int statusCode, int remaining)
+{
+    if(index < 0 || index >= keys.size()) return;
+
+    Key &key = keys[index];
+
+    // rate limited, leave the key alone for a second
+    if(statusCode == 429) key.tokens = qMin(key.tokens, -key.rate);
+    else if(remaining >= 0) key.tokens = qMin(key.tokens, double(remaining));
+}
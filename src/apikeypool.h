@@ -0,0 +1,63 @@
+#ifndef APIKEYPOOL_H
+#define APIKEYPOOL_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QNetworkRequest>
+
+namespace SendGrid {
+
+// a set of api keys, or subusers sent on behalf of, each with a weight and a
+// token bucket refilled at its rate limit. requests go to the key with the
+// most weighted headroom, so throughput adds up over the keys, and wait once
+// every bucket is dry
+class ApiKeyPool
+{
+public:
+    ApiKeyPool();
+
+    // rate is in requests per second, the bucket holds up to one second of it
+    // and at least one request.
+    // onBehalfOf names a subuser, key is then the parent account key
+    void addKey(QByteArray key, double rate, double weight = 1, QByteArray onBehalfOf = {});
+
+    bool isEmpty();
+    int count();
+
+    // the key with the most headroom among those with a token, or the one that
+    // gets a token first if none has. takes nothing, see acquire
+    int pick();
+
+    // takes a token from the key, returns 0 if it had one and otherwise the ms
+    // until it will
+    int acquire(int index);
+
+    void apply(int index, QNetworkRequest &request);
+
+    // syncs a bucket with what SendGrid reports, remaining is -1 if not reported
+    void update(int index, int statusCode, int remaining);
+
+    // request attribute carrying the index of the key a request went out with
+    static const QNetworkRequest::Attribute KeyAttribute;
+
+private:
+    struct Key
+    {
+        QByteArray authorization;
+        QByteArray onBehalfOf;
+        double rate;
+        double weight;
+        double tokens;
+    };
+
+    void refill();
+    static double capacity(const Key &key);
+
+    QVector<Key> keys;
+    QElapsedTimer clock;
+    qint64 lastRefill = 0;
+};
+
+}
+#endif // APIKEYPOOL_H
@@ -1,32 +1,124 @@
 #include "configi.h"
 
+#include <QThread>
+#include <QSaveFile>
+#include <QCryptographicHash>
+
 Configi::Configi()
 {
+    current.storeRelease(new Snapshot());
+
+    // one reparse at a time, later changes are picked up by the running one
+    pool.setMaxThreadCount(1);
+}
+
+Configi::~Configi()
+{
+    delete watcher;
+    pool.waitForDone();
+
+    delete current.loadAcquire();
+}
+
+Configi::ReadGuard::ReadGuard(Configi *configi):
+    configi {configi}
+{
+    phase = configi->phase.loadAcquire();
+    configi->readers[phase].ref();
+
+    snapshot = configi->current.loadAcquire();
+}
 
+Configi::ReadGuard::~ReadGuard()
+{
+    configi->readers[phase].deref();
+}
+
+void Configi::publish(Snapshot *snapshot)
+{
+    // callers hold writeLock
+    Snapshot *old = current.fetchAndStoreOrdered(snapshot);
+
+    // a reader holding old counted itself before the swap, in either counter
+    // since it may have read the phase before an earlier flip. flipping twice
+    // and waiting for each counter to drain covers both, while readers that
+    // start meanwhile count into the other counter and don't hold us up
+    for(int round = 0; round < 2; round++)
+    {
+        int previous = phase.fetchAndStoreOrdered(1 - phase.loadAcquire());
+
+        while(readers[previous].loadAcquire() != 0) QThread::yieldCurrentThread();
+    }
+
+    delete old;
 }
 
 void Configi::read(QString file)
+{
+    ConfigiError error {NoConfigiError, file, 0};
+    Snapshot *snapshot = parse(readFile(file), error);
+
+    QMutexLocker locker(&writeLock);
+
+    // the watch follows the last file read, see watch()
+    if(watcher && file != m_error.file)
+    {
+        if(!m_error.file.isEmpty()) watcher->removePath(m_error.file);
+        if(!file.isEmpty()) watcher->addPath(file);
+    }
+
+    m_error = error;
+    if(!snapshot) return;
+
+    // sections read from other files before are kept
+    Snapshot *merged = new Snapshot(*current.loadAcquire());
+
+    for(const QString &name : snapshot->order)
+    {
+        if(!merged->sections.contains(name)) merged->order.append(name);
+        merged->sections.insert(name, snapshot->sections.value(name));
+    }
+
+    // this is the file watch() follows from now on
+    fileSections = QSet<QString>(snapshot->order.constBegin(), snapshot->order.constEnd());
+
+    delete snapshot;
+    publish(merged);
+}
+
+QByteArray Configi::readFile(QString file)
 {
     QFile filetoread(file);
-    m_error.file = file;
 
-    if (filetoread.open(QFile::ReadWrite)) {
+    if (!filetoread.open(QFile::ReadOnly)) {
+        qDebug() << "Configi: couldn't open ini file";
+        return QByteArray();
+    }
+
+    return filetoread.readAll();
+}
+
+Configi::Snapshot *Configi::parse(const QByteArray &data, ConfigiError &error)
+{
+    if(data.isNull()) return nullptr;
 
-        QTextStream stream(&filetoread);
+    Snapshot *snapshot = new Snapshot();
+    ConfigiSection *ongoingSection = nullptr;
+    int currentLine = 0;
 
-        while(!stream.atEnd()){
+    QTextStream stream(data);
 
-            currentLine++;
+    while(!stream.atEnd()){
 
-            parseLine(stream.readLine().trimmed());
-        }
+        currentLine++;
+
+        parseLine(stream.readLine().trimmed(), snapshot, ongoingSection, currentLine, error);
     }
-    else qDebug() << "Configi: couldn't open ini file";
 
-    filetoread.close();
+    return snapshot;
 }
 
-void Configi::parseLine(QString line)
+void Configi::parseLine(QString line, Snapshot *snapshot, ConfigiSection *&ongoingSection, int currentLine, ConfigiError &error)
 {
     if(line.isEmpty()) return;
 
@@ -42,14 +134,16 @@ void Configi::parseLine(QString line)
             // create a new secton
             QString sectionName = line.remove("[").remove("]");
             ongoingSection = new ConfigiSection(sectionName);
-            m_sections.insert(sectionName, ongoingSection);
+
+            if(!snapshot->sections.contains(sectionName)) snapshot->order.append(sectionName);
+            snapshot->sections.insert(sectionName, QSharedPointer<ConfigiSection>(ongoingSection));
 
             return;
         }
         else // invalid section name
         {
-            m_error.error = InvalidSection;
-            m_error.line = currentLine;
+            error.error = InvalidSection;
+            error.line = currentLine;
             return;
         }
     }
@@ -61,130 +155,305 @@ void Configi::parseLine(QString line)
     // if not comment or sesction, it must be a key-value
     QStringList keyValue = line.split("=");
 
-    if(keyValue.size() == 2)
+    if(keyValue.size() == 2 && ongoingSection)
     {
         ongoingSection->values.insert(keyValue.at(0).trimmed(), keyValue.at(1).trimmed());
     }
-    else //InvalidKey
+    else //InvalidKey, or a key before any section
     {
-        m_error.error = InvalidKeyOrValue;
-        m_error.line = currentLine;
+        error.error = InvalidKeyOrValue;
+        error.line = currentLine;
     }
 }
 
-QVariant Configi::get(QString section, QString key, QString defaultValue){
+void Configi::watch(bool enable)
+{
+    delete watcher;
+    watcher = nullptr;
+
+    if(!enable) return;
+
+    watcher = new QFileSystemWatcher();
+
+    QMutexLocker locker(&writeLock);
+    if(!m_error.file.isEmpty()) watcher->addPath(m_error.file);
+
+    QObject::connect(watcher, &QFileSystemWatcher::fileChanged, [this](const QString &path){
+
+        // editors that save by renaming drop the file from the watch
+        if(!watcher->files().contains(path) && QFile::exists(path)) watcher->addPath(path);
+
+        reload();
+    });
+}
+
+void Configi::reload()
+{
+    // a reparse is already queued or running, it runs once more for this change
+    if(reloadRequests.fetchAndAddOrdered(1) > 0) return;
+
+    pool.start(QRunnable::create([this]{
+
+        do
+        {
+            reloadRequests.storeRelease(1);
+
+            QString file;
+            QByteArray saved;
+            {
+                QMutexLocker locker(&writeLock);
+                file = m_error.file;
+                saved = savedHash;
+            }
+
+            QByteArray data = readFile(file);
+
+            // our own save, the values are already current
+            if(QCryptographicHash::hash(data, QCryptographicHash::Sha1) == saved) continue;
+
+            ConfigiError error {NoConfigiError, file, 0};
+            Snapshot *snapshot = parse(data, error);
 
-    ConfigiSection *sction = m_sections.value(section);
+            QMutexLocker locker(&writeLock);
+
+            // keep serving the last good values
+            if(!snapshot || error.error != NoConfigiError) {
+                delete snapshot;
+                qDebug() << "Configi: keeping previous values, couldn't reload" << file << "at line" << error.line;
+                continue;
+            }
+
+            m_error = error;
+
+            // merged like read(), sections the file no longer has are dropped
+            // unless they hold unsaved values, which win over the file's
+            Snapshot *merged = new Snapshot(*current.loadAcquire());
+
+            for(const QString &name : qAsConst(fileSections))
+            {
+                if(snapshot->sections.contains(name)) continue;
+
+                if(unsaved.contains(name)) {
+                    QSharedPointer<ConfigiSection> kept(new ConfigiSection(name));
+                    kept->values = unsaved.value(name);
+                    merged->sections.insert(name, kept);
+                }
+                else {
+                    merged->sections.remove(name);
+                    merged->order.removeAll(name);
+                }
+            }
+
+            for(const QString &name : qAsConst(snapshot->order))
+            {
+                QSharedPointer<ConfigiSection> sction = snapshot->sections.value(name);
+                const QHash<QString, QVariant> values = unsaved.value(name);
+
+                for(auto it = values.constBegin(); it != values.constEnd(); ++it) sction->values.insert(it.key(), it.value());
+
+                if(!merged->sections.contains(name)) merged->order.append(name);
+                merged->sections.insert(name, sction);
+            }
+
+            fileSections = QSet<QString>(snapshot->order.constBegin(), snapshot->order.constEnd());
+
+            delete snapshot;
+            publish(merged);
+        }
+        while(reloadRequests.fetchAndAddOrdered(-1) > 1);
+    }));
+}
+
+void Configi::setParent(Configi *parent){
+
+    this->parent.storeRelease(parent);
+}
+
+QVariant Configi::get(QString section, QString key, QString defaultValue){
 
-    if(sction)
     {
-        // if value found, return it
-        if(sction->values.contains(key))
-            return sction->values.value(key);
+        ReadGuard guard(this);
 
-        // else, return inheretd value, if any
-        else if(parent) return parent->get(section, key, defaultValue);
+        auto sction = guard.snapshot->sections.constFind(section);
 
-        // else, return an empty value
-        else return defaultValue;
+        // if value found, return it
+        if(sction != guard.snapshot->sections.constEnd())
+        {
+            auto value = sction.value()->values.constFind(key);
+
+            if(value != sction.value()->values.constEnd()) return value.value();
+        }
     }
 
     // else, return inheretd value, if any
-    else if(parent) return parent->get(section, key, defaultValue);
+    if(Configi *inherited = parent.loadAcquire()) return inherited->get(section, key, defaultValue);
 
     // else, return an empty value
-    else return defaultValue;
+    return defaultValue;
+}
+
+void Configi::update(QString section, QString key, QVariant value)
+{
+    QMutexLocker locker(&writeLock);
+
+    // copy on write, only the changed section is duplicated
+    Snapshot *snapshot = new Snapshot(*current.loadAcquire());
+
+    QSharedPointer<ConfigiSection> old = snapshot->sections.value(section);
+    QSharedPointer<ConfigiSection> changed(old ? new ConfigiSection(*old) : new ConfigiSection(section));
+
+    if(!old) snapshot->order.append(section);
+
+    changed->values[key] = value;
+    snapshot->sections.insert(section, changed);
+
+    unsaved[section].insert(key, value);
+
+    publish(snapshot);
 }
 
 void Configi::set(QString section, QString key, QString value){
 
-    if(m_sections.contains(section))
-        m_sections[section]->values[key] = value;
-    else {
-        m_sections.insert(section, new ConfigiSection(section));
-        m_sections[section]->values[key] = value;
-    }
+    update(section, key, value);
 }
 
 void Configi::set(QString section, QString key, QStringList value){
 
-    if(m_sections.contains(section))
-        m_sections[section]->values[key] = value.join(",");
-    else {
-        m_sections.insert(section, new ConfigiSection(section));
-        m_sections[section]->values[key] = value.join(",");
-    }
+    update(section, key, value.join(","));
 }
 
 void Configi::set(QString section, QString key, int value){
 
-    m_sections[section]->values[key] = value;
+    update(section, key, value);
 }
 void Configi::set(QString section, QString key, long value){
 
-    //m_sections[section]->values[key] = value;
+    update(section, key, qlonglong(value));
 }
 void Configi::set(QString section, QString key, double value){
 
-    m_sections[section]->values[key] = value;
+    update(section, key, value);
 }
 void Configi::set(QString section, QString key, QDate value){
 
-    m_sections[section]->values[key] = value;
+    update(section, key, value);
 }
 void Configi::set(QString section, QString key, QTime value){
 
-    m_sections[section]->values[key] = value;
+    update(section, key, value);
 }
 void Configi::set(QString section, QString key, QDateTime value){
 
-    m_sections[section]->values[key] = value;
+    update(section, key, value);
 }
 
 ConfigiError Configi::error(){
 
+    QMutexLocker locker(&writeLock);
     return m_error;
 }
 
-ConfigiSection *Configi::section(QString name){
+// the sections are never changed once published, holding a reference keeps
+// one alive after its snapshot is replaced
+QSharedPointer<const ConfigiSection> Configi::section(QString name){
 
-    return m_sections.value(name);
+    ReadGuard guard(this);
+    return guard.snapshot->sections.value(name);
 }
-QList<ConfigiSection*> Configi::sections(){
+QList<QSharedPointer<const ConfigiSection>> Configi::sections(){
+
+    ReadGuard guard(this);
+    QList<QSharedPointer<const ConfigiSection>> list;
+
+    for(const QString &name : guard.snapshot->order) list.append(guard.snapshot->sections.value(name));
 
-    return m_sections.values();
+    return list;
 }
 
 QStringList Configi::sectionsNames(){
 
-    return m_sections.keys();
+    ReadGuard guard(this);
+    return guard.snapshot->order;
+}
+
+QByteArray Configi::serialize(const ConfigiSection *sction)
+{
+    QByteArray text = "[" + sction->name.toUtf8() + "]\n";
+
+    for(auto it = sction->values.constBegin(); it != sction->values.constEnd(); ++it)
+    {
+        text += it.key().toUtf8() + " = " + it.value().toString().toUtf8() + "\n";
+    }
+
+    text += "\n\n"; // separate section with an empty line
+
+    return text;
 }
 
 void Configi::save()
 {
     qDebug() << "Configi: saving";
 
-    // not to be confusing, file name is just added to m_error at read() function
-    QFile filetosave(m_error.file);
+    // one save at a time, so an older snapshot never lands over a newer one
+    QMutexLocker saving(&saveLock);
+
+    QString file;
+    QByteArray data;
+    QHash<QString, SavedSection> texts;
+    QHash<QString, QHash<QString, QVariant>> written;
+    QStringList order;
 
-    if (filetosave.open(QFile::WriteOnly | QFile::Truncate)) {
+    // the bytes are built under writeLock, writing them is not, so set() and
+    // get() don't wait for the disk
+    {
+        QMutexLocker locker(&writeLock);
 
-        QTextStream stream(&filetosave);
+        const Snapshot *snapshot = current.loadAcquire();
 
-        for(ConfigiSection *sction : m_sections)
+        // a section is serialized again only if it changed since the last save,
+        // every change replaces the section object so comparing pointers is enough
+        for(const QString &name : snapshot->order)
         {
-            stream << "[" << sction->name << "]" << "\n";
+            QSharedPointer<ConfigiSection> sction = snapshot->sections.value(name);
+            SavedSection saved = savedSections.value(name);
 
-            for (QString key: sction->values.keys())
-            {
-                stream << key << " = " << sction->values.value(key).toString() << "\n";
-            }
+            if(saved.section != sction) saved = {sction, serialize(sction.data())};
 
-            stream << "\n\n"; // separate section with an empty line
+            data += saved.text;
+            texts.insert(name, saved);
         }
+
+        // not to be confusing, file name is just added to m_error at read() function
+        file = m_error.file;
+        written = unsaved;
+        order = snapshot->order;
     }
-    else qDebug() << "Configi: couldn't open ini file for saving";
 
-    filetosave.close();
+    // QSaveFile writes a temporary file, syncs it and renames it over the old one,
+    // so a crash leaves either the old file or the new one
+    QSaveFile filetosave(file);
+
+    if (!filetosave.open(QFile::WriteOnly) || filetosave.write(data) != data.size() || !filetosave.commit()) {
+        qDebug() << "Configi: couldn't save ini file" << filetosave.errorString();
+        return;
+    }
+
+    QMutexLocker locker(&writeLock);
+
+    savedSections = texts;
+    savedHash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+
+    // values set while the file was written are still unsaved
+    for(auto section = written.constBegin(); section != written.constEnd(); ++section)
+    {
+        auto pending = unsaved.find(section.key());
+        if(pending == unsaved.end()) continue;
+
+        for(auto it = section.value().constBegin(); it != section.value().constEnd(); ++it)
+            if(pending->value(it.key()) == it.value()) pending->remove(it.key());
+
+        if(pending->isEmpty()) unsaved.erase(pending);
+    }
 
+    fileSections = QSet<QString>(order.constBegin(), order.constEnd());
 }
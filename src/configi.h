@@ -8,6 +8,13 @@
 #include <QTextStream>
 #include <QDebug>
 #include <QDateTime>
+#include <QHash>
+#include <QSet>
+#include <QSharedPointer>
+#include <QAtomicPointer>
+#include <QMutex>
+#include <QThreadPool>
+#include <QFileSystemWatcher>
 
 struct ConfigiError
 {
@@ -18,6 +25,7 @@ struct ConfigiError
 
 enum ConfigiErrors
 {
+    NoConfigiError = -1,
     InvalidSection,
     InvalidKeyOrValue
 };
@@ -30,10 +38,20 @@ struct ConfigiSection
     QHash<QString, QVariant> values;
 };
 
+// the sections live in immutable snapshots. readers take the current one
+// without locking, every change (set, read or a reload of the watched file)
+// builds a new snapshot and swaps it in, and the old one is freed once no
+// reader can still be using it. unchanged sections are shared between
+// snapshots.
+//
+// everything is safe on any thread. section() and sections() hand out the
+// sections of the snapshot current at the call, they stay valid and unchanged
+// for as long as they are held, later changes are seen by asking again
 class Configi
 {
 public:
     Configi();
+    ~Configi();
 
     QVariant get(QString section, QString key, QString defaultValue = "");
 
@@ -49,20 +67,90 @@ public:
     void read(QString file);
     void save();
 
+    // re-reads the last file read whenever it changes on disk, the file is
+    // parsed on a worker thread and its sections replace those it had before.
+    // sections read from other files and values set() since the last save are
+    // kept, a file that fails to parse leaves everything as it was. needs an
+    // event loop on the calling thread
+    void watch(bool enable = true);
+
+    // keys missing here are looked up in parent, which outlives this Configi
+    void setParent(Configi *parent);
+
     ConfigiError error();
 
-    ConfigiSection *section(QString name);
-    QList<ConfigiSection*> sections();
+    QSharedPointer<const ConfigiSection> section(QString name);
+    QList<QSharedPointer<const ConfigiSection>> sections();
     QStringList sectionsNames();
 
 private:
-    void parseLine(QString line);
+    struct Snapshot
+    {
+        QHash<QString, QSharedPointer<ConfigiSection>> sections;
+
+        // section names in file order, so saving keeps the layout
+        QStringList order;
+    };
+
+    // a section as it was last saved, with its text
+    struct SavedSection
+    {
+        QSharedPointer<ConfigiSection> section;
+        QByteArray text;
+    };
+
+    // keeps the snapshot it was created with alive until it goes out of scope
+    class ReadGuard
+    {
+    public:
+        ReadGuard(Configi *configi);
+        ~ReadGuard();
+
+        const Snapshot *snapshot;
+
+    private:
+        Configi *configi;
+        int phase;
+    };
+
+    static QByteArray readFile(QString file);
+    static Snapshot *parse(const QByteArray &data, ConfigiError &error);
+    static QByteArray serialize(const ConfigiSection *section);
+    static void parseLine(QString line, Snapshot *snapshot, ConfigiSection *&ongoingSection, int currentLine, ConfigiError &error);
+
+    void update(QString section, QString key, QVariant value);
+    void publish(Snapshot *snapshot);
+    void reload();
+
+    QAtomicPointer<Configi> parent;
+
+    QAtomicPointer<Snapshot> current;
+
+    // readers count themselves in the counter of the phase they started in,
+    // a writer flips the phase and waits for the other counter to drain
+    QAtomicInt readers[2];
+    QAtomicInt phase;
+
+    // serializes writers, and guards m_error
+    QMutex writeLock;
+
+    // serializes saves, held while the file is written but not by writers
+    QMutex saveLock;
+
+    QFileSystemWatcher *watcher = nullptr;
+    QThreadPool pool;
+    QAtomicInt reloadRequests;
+
+    ConfigiError m_error {NoConfigiError, QString(), 0};
+
+    // guarded by writeLock
+    QHash<QString, SavedSection> savedSections;
+    QByteArray savedHash;
 
-    Configi *parent = nullptr;
-    QHash<QString, ConfigiSection *> m_sections;
-    ConfigiSection *ongoingSection = nullptr;
-    ConfigiError m_error;
-    int currentLine = 0;
+    // also guarded by writeLock, what a reload of the watched file must not lose:
+    // values set() since the last save, and which sections came from the file
+    QHash<QString, QHash<QString, QVariant>> unsaved;
+    QSet<QString> fileSections;
 };
 
 #endif // CONFIGI_H
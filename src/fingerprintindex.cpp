@@ -0,0 +1,161 @@
+#include "fingerprintindex.h"
+
+using namespace SendGrid;
+
+FingerprintIndex::FingerprintIndex(int capacity, qint64 window):
+    capacity {qMax(capacity, 2 * BucketSize)},
+    window {qMax<qint64>(window, 1)}
+{
+    // room for the whole capacity at ~90% load, rounded up to a power of two
+    quint32 count = 1;
+    while(count * BucketSize * 9 < quint32(this->capacity) * 10) count <<= 1;
+
+    buckets.fill(0, int(count * BucketSize));
+    bucketMask = count - 1;
+}
+
+quint16 FingerprintIndex::tag(quint64 fingerprint)
+{
+    // 0 marks an empty slot
+    quint16 t = quint16(fingerprint >> 48);
+    return t ? t : 1;
+}
+
+quint32 FingerprintIndex::index(quint64 fingerprint)
+{
+    return quint32(fingerprint) & bucketMask;
+}
+
+quint32 FingerprintIndex::altIndex(quint32 index, quint16 tag)
+{
+    // partial key cuckoo hashing, the alternate bucket only depends on the tag
+    return (index ^ (quint32(tag) * 0x5bd1e995u)) & bucketMask;
+}
+
+bool FingerprintIndex::bucketContains(quint32 bucket, quint16 tag)
+{
+    const quint16 *slots = buckets.constData() + bucket * BucketSize;
+
+    return slots[0] == tag || slots[1] == tag || slots[2] == tag || slots[3] == tag;
+}
+
+bool FingerprintIndex::bucketInsert(quint32 bucket, quint16 tag)
+{
+    quint16 *slots = buckets.data() + bucket * BucketSize;
+
+    for(int i = 0; i < BucketSize; i++)
+    {
+        if(!slots[i]) {
+            slots[i] = tag;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool FingerprintIndex::bucketRemove(quint32 bucket, quint16 tag)
+{
+    quint16 *slots = buckets.data() + bucket * BucketSize;
+
+    for(int i = 0; i < BucketSize; i++)
+    {
+        if(slots[i] == tag) {
+            slots[i] = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool FingerprintIndex::filterContains(quint64 fingerprint)
+{
+    quint16 t = tag(fingerprint);
+    quint32 i = index(fingerprint);
+
+    return bucketContains(i, t) || bucketContains(altIndex(i, t), t);
+}
+
+bool FingerprintIndex::filterInsert(quint64 fingerprint)
+{
+    quint16 t = tag(fingerprint);
+    quint32 i = index(fingerprint);
+
+    if(bucketInsert(i, t) || bucketInsert(altIndex(i, t), t)) return true;
+
+    // both buckets are full, kick tags around until one lands in a free slot
+    for(int kick = 0; kick < MaxKicks; kick++)
+    {
+        kickSeed = kickSeed * 1664525u + 1013904223u;
+
+        quint16 &slot = buckets[int(i * BucketSize + (kickSeed >> 30))];
+        qSwap(slot, t);
+
+        i = altIndex(i, t);
+        if(bucketInsert(i, t)) return true;
+    }
+
+    // t is lost from the filter, the exact sets still hold it
+    return false;
+}
+
+void FingerprintIndex::expire(qint64 now)
+{
+    if(!generationStart) generationStart = now;
+
+    if(now - generationStart >= window || current.size() >= capacity / 2) rotate(now);
+}
+
+void FingerprintIndex::rotate(qint64 now)
+{
+    previous.swap(current);
+    current.clear();
+    generationStart = now;
+
+    // rebuild the filter from the surviving generation
+    buckets.fill(0);
+    saturated = false;
+
+    for(quint64 fingerprint : previous)
+        if(!filterInsert(fingerprint)) saturated = true;
+}
+
+bool FingerprintIndex::contains(quint64 fingerprint, qint64 now)
+{
+    expire(now);
+
+    if(!saturated && !filterContains(fingerprint)) return false;
+
+    return current.contains(fingerprint) || previous.contains(fingerprint);
+}
+
+void FingerprintIndex::insert(quint64 fingerprint, qint64 now)
+{
+    expire(now);
+
+    if(current.contains(fingerprint) || previous.contains(fingerprint)) return;
+
+    current.insert(fingerprint);
+
+    if(!filterInsert(fingerprint)) saturated = true;
+}
+
+void FingerprintIndex::remove(quint64 fingerprint)
+{
+    if(!current.remove(fingerprint) && !previous.remove(fingerprint)) return;
+
+    // a saturated filter may have lost the tag, taking out an equal one could
+    // hide another fingerprint. lookups go to the exact sets until rotation anyway
+    if(saturated) return;
+
+    quint16 t = tag(fingerprint);
+    quint32 i = index(fingerprint);
+
+    if(!bucketRemove(i, t)) bucketRemove(altIndex(i, t), t);
+}
+
+int FingerprintIndex::count()
+{
+    return current.size() + previous.size();
+}
@@ -0,0 +1,58 @@
+#ifndef FINGERPRINTINDEX_H
+#define FINGERPRINTINDEX_H
+
+#include <QSet>
+#include <QVector>
+
+namespace SendGrid {
+
+// bounded, time windowed set of 64 bit fingerprints. a cuckoo filter holding
+// 16 bit tags answers most lookups, only its positives are confirmed against
+// the exact sets. entries are kept in two generations, an entry is remembered
+// for at least window seconds, or until capacity forces an early rotation.
+class FingerprintIndex
+{
+public:
+    FingerprintIndex(int capacity = 1 << 20, qint64 window = 24 * 3600);
+
+    bool contains(quint64 fingerprint, qint64 now);
+    void insert(quint64 fingerprint, qint64 now);
+    void remove(quint64 fingerprint);
+
+    int count();
+
+private:
+    static const int BucketSize = 4;
+    static const int MaxKicks = 500;
+
+    quint16 tag(quint64 fingerprint);
+    quint32 index(quint64 fingerprint);
+    quint32 altIndex(quint32 index, quint16 tag);
+
+    bool filterContains(quint64 fingerprint);
+    bool filterInsert(quint64 fingerprint);
+    bool bucketInsert(quint32 bucket, quint16 tag);
+    bool bucketContains(quint32 bucket, quint16 tag);
+    bool bucketRemove(quint32 bucket, quint16 tag);
+
+    void expire(qint64 now);
+    void rotate(qint64 now);
+
+    QVector<quint16> buckets;
+    quint32 bucketMask;
+
+    // set when the filter ran out of room, lookups go to the exact sets
+    // until the next rotation rebuilds it
+    bool saturated = false;
+
+    QSet<quint64> current;
+    QSet<quint64> previous;
+    qint64 generationStart = 0;
+
+    int capacity;
+    qint64 window;
+    quint32 kickSeed = 0x9e3779b9;
+};
+
+}
+#endif // FINGERPRINTINDEX_H
@@ -0,0 +1,184 @@
+#ifndef JSONSCAN_H
+#define JSONSCAN_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <cstring>
+
+namespace SendGrid {
+
+// JSON scanning in place over raw bytes, for input too large or too hot to go
+// through QJsonDocument. p is advanced past what was consumed
+namespace JsonScan {
+
+inline void skipSpace(const char *&p, const char *end)
+{
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+}
+
+inline void appendUtf8(QByteArray &out, uint code)
+{
+    if(code < 0x80) out += char(code);
+    else if(code < 0x800) {
+        out += char(0xC0 | (code >> 6));
+        out += char(0x80 | (code & 0x3F));
+    }
+    else if(code < 0x10000) {
+        out += char(0xE0 | (code >> 12));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    }
+    else {
+        out += char(0xF0 | (code >> 18));
+        out += char(0x80 | ((code >> 12) & 0x3F));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    }
+}
+
+inline bool hex4(const char *p, const char *end, uint &code)
+{
+    if(end - p < 4) return false;
+
+    code = 0;
+
+    for(int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        code <<= 4;
+
+        if(c >= '0' && c <= '9') code |= uint(c - '0');
+        else if(c >= 'a' && c <= 'f') code |= uint(c - 'a' + 10);
+        else if(c >= 'A' && c <= 'F') code |= uint(c - 'A' + 10);
+        else return false;
+    }
+
+    return true;
+}
+
+// p is on the opening quote, the raw field points into the input
+inline bool scanString(const char *&p, const char *end, const char *&data, int &size, bool &escaped)
+{
+    data = ++p;
+    escaped = false;
+
+    while(p < end && *p != '"')
+    {
+        if(*p == '\\') {
+            escaped = true;
+            p++;
+        }
+
+        p++;
+    }
+
+    if(p >= end) return false;
+
+    size = int(p - data);
+    p++;
+
+    return true;
+}
+
+inline QString decodeString(const char *data, int size, bool escaped)
+{
+    if(!escaped) return QString::fromUtf8(data, size);
+
+    QByteArray out;
+    out.reserve(size);
+
+    const char *end = data + size;
+
+    for(const char *p = data; p < end; p++)
+    {
+        if(*p != '\\' || p + 1 >= end) {
+            out += *p;
+            continue;
+        }
+
+        switch (*++p) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            uint code;
+            if(!hex4(p + 1, end, code)) break;
+            p += 4;
+
+            // surrogate pair
+            uint low;
+            if(code >= 0xD800 && code < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u' && hex4(p + 3, end, low)
+                    && low >= 0xDC00 && low < 0xE000) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+
+            appendUtf8(out, code);
+            break;
+        }
+        default: out += *p; // \" \\ \/
+        }
+    }
+
+    return QString::fromUtf8(out);
+}
+
+inline bool keyIs(const char *data, int size, const char *name)
+{
+    return size == int(std::strlen(name)) && std::memcmp(data, name, size_t(size)) == 0;
+}
+
+// skips one value of any kind, nested arrays and objects included
+inline bool skipValue(const char *&p, const char *end)
+{
+    if(p >= end) return false;
+
+    if(*p == '"')
+    {
+        const char *data;
+        int size;
+        bool escaped;
+
+        return scanString(p, end, data, size, escaped);
+    }
+
+    if(*p != '{' && *p != '[')
+    {
+        const char *start = p;
+        while(p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+
+        return p > start;
+    }
+
+    int depth = 0;
+
+    while(p < end)
+    {
+        char c = *p;
+
+        if(c == '"')
+        {
+            const char *data;
+            int size;
+            bool escaped;
+
+            if(!scanString(p, end, data, size, escaped)) return false;
+            continue;
+        }
+
+        p++;
+
+        if(c == '{' || c == '[') depth++;
+        else if((c == '}' || c == ']') && --depth == 0) return true;
+    }
+
+    return false;
+}
+
+}
+
+}
+#endif // JSONSCAN_H
@@ -41,14 +41,14 @@ private:
 
     void typesToExtentions(){
 
-        ConfigiSection *mime_section = configi.section("MIME-TYPES");
+        QSharedPointer<const ConfigiSection> mime_section = configi.section("MIME-TYPES");
 
         if(mime_section)
         {
             for(QString type : mime_section->values.keys())
             {
                 // list all extentions for every key
-                QByteArrayList extentions = mime_section->values[type].toByteArray().split(',');
+                QByteArrayList extentions = mime_section->values.value(type).toByteArray().split(',');
 
                 // map extention for it's type
                 for (QByteArray ext : extentions)
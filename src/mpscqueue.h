@@ -0,0 +1,66 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+namespace SendGrid {
+
+// lock free multi producer single consumer queue (Vyukov). push is wait free,
+// pop may briefly miss an item whose producer has not linked it yet, callers
+// keep their own count to tell that apart from an empty queue
+template<typename T> class MpscQueue
+{
+public:
+    MpscQueue(): head {new Node}, tail {head.load()} {}
+
+    ~MpscQueue()
+    {
+        T value;
+        while(pop(value)) {}
+
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // any thread
+    void push(T value)
+    {
+        Node *node = new Node;
+        node->value = std::move(value);
+
+        Node *previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // consumer thread only
+    bool pop(T &value)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if(!next) return false;
+
+        // next becomes the new stub, its value is moved out
+        value = std::move(next->value);
+        next->value = T();
+
+        delete tail;
+        tail = next;
+
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next {nullptr};
+        T value;
+    };
+
+    std::atomic<Node *> head;
+    Node *tail;
+};
+
+}
+#endif // MPSCQUEUE_H
@@ -0,0 +1,385 @@
+#include "recipientreader.h"
+#include "jsonscan.h"
+
+#include <QFile>
+
+#include <cstring>
+
+using namespace SendGrid;
+using namespace SendGrid::JsonScan;
+
+RecipientReader::RecipientReader(QString file, Format format):
+    file {file},
+    format {format}
+{
+
+}
+
+void RecipientReader::setBatchSize(int size){
+    batchSize = qMax(1, size);
+}
+
+void RecipientReader::setTagFormat(QString format){
+    tagFormat = format;
+}
+
+qint64 RecipientReader::rows(){
+    return m_rows;
+}
+
+qint64 RecipientReader::skipped(){
+    return m_skipped;
+}
+
+QString RecipientReader::errorString(){
+    return m_error;
+}
+
+bool RecipientReader::read(Consumer consumer)
+{
+    QFile input(file);
+
+    if(!input.open(QIODevice::ReadOnly)) {
+        m_error = "couldn't open " + file;
+        return false;
+    }
+
+    const qint64 size = input.size();
+    qint64 offset = 0;
+
+    QList<Personalization> batch;
+    batch.reserve(batchSize);
+
+    haveHeader = false;
+    m_rows = 0;
+    m_skipped = 0;
+    m_error.clear();
+
+    while(offset < size)
+    {
+        qint64 length = qMin(WindowSize, size - offset);
+        bool atEnd = offset + length == size;
+
+        uchar *window = input.map(offset, length);
+
+        if(!window) {
+            m_error = input.errorString();
+            return false;
+        }
+
+        const char *begin = reinterpret_cast<const char *>(window);
+        const char *end = begin + length;
+        const char *p = begin;
+
+        // skip a UTF-8 byte order mark
+        if(offset == 0 && length >= 3 && std::memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+
+        while(p < end)
+        {
+            const char *next = format == Csv ? parseCsvRecord(p, end, atEnd) : parseJsonRecord(p, end, atEnd);
+
+            // the record runs past the window, the next window starts with it
+            if(!next) break;
+
+            Personalization personalization;
+            bool valid = format == Csv ? csvPersonalization(personalization)
+                                       : jsonPersonalization(p, next, personalization);
+
+            p = next;
+
+            if(!valid) continue;
+
+            batch.append(personalization);
+            m_rows++;
+
+            if(batch.size() == batchSize)
+            {
+                bool proceed = consumer(batch);
+                batch.clear();
+
+                if(!proceed) {
+                    input.unmap(window);
+                    return true;
+                }
+            }
+        }
+
+        if(p == begin) {
+            input.unmap(window);
+            m_error = "record longer than the mapping window";
+            return false;
+        }
+
+        offset += p - begin;
+        input.unmap(window);
+    }
+
+    if(!batch.isEmpty()) consumer(batch);
+
+    return true;
+}
+
+const char *RecipientReader::parseCsvRecord(const char *p, const char *end, bool atEnd)
+{
+    fields.clear();
+
+    forever
+    {
+        Field field {p, 0, false};
+
+        if(p < end && *p == '"')
+        {
+            // quoted field, may hold separators and newlines, "" is an escaped quote
+            field.data = ++p;
+
+            forever
+            {
+                const char *quote = static_cast<const char *>(std::memchr(p, '"', size_t(end - p)));
+
+                if(!quote) return nullptr;
+
+                // can't tell a closing quote from an escaped one yet
+                if(quote + 1 == end && !atEnd) return nullptr;
+
+                if(quote + 1 < end && quote[1] == '"') {
+                    field.escaped = true;
+                    p = quote + 2;
+                    continue;
+                }
+
+                field.size = int(quote - field.data);
+                p = quote + 1;
+                break;
+            }
+
+            // anything between the closing quote and the separator is dropped
+            while(p < end && *p != ',' && *p != '\n') p++;
+        }
+        else
+        {
+            const char *q = p;
+            while(q < end && *q != ',' && *q != '\n') q++;
+
+            field.size = int(q - p);
+            if(field.size && q[-1] == '\r' && (q == end || *q == '\n')) field.size--;
+
+            p = q;
+        }
+
+        fields.append(field);
+
+        if(p == end) return atEnd ? p : nullptr;
+        if(*p == '\n') return p + 1;
+
+        p++; // ','
+    }
+}
+
+QString RecipientReader::csvString(const Field &field)
+{
+    if(!field.escaped) return QString::fromUtf8(field.data, field.size);
+
+    return QString::fromUtf8(QByteArray(field.data, field.size).replace("\"\"", "\""));
+}
+
+void RecipientReader::csvHeader()
+{
+    columns.clear();
+    emailColumn = nameColumn = subjectColumn = -1;
+
+    for(int i = 0; i < fields.size(); i++)
+    {
+        QString column = csvString(fields.at(i)).trimmed();
+
+        if(column.compare("email", Qt::CaseInsensitive) == 0) emailColumn = i;
+        else if(column.compare("name", Qt::CaseInsensitive) == 0) nameColumn = i;
+        else if(column.compare("subject", Qt::CaseInsensitive) == 0) subjectColumn = i;
+
+        columns.append(tagFormat.arg(column));
+    }
+
+    haveHeader = true;
+}
+
+bool RecipientReader::csvPersonalization(Personalization &personalization)
+{
+    if(!haveHeader) {
+        csvHeader();
+        return false;
+    }
+
+    // blank line
+    if(fields.size() == 1 && fields.at(0).size == 0) return false;
+
+    if(emailColumn < 0 || emailColumn >= fields.size() || fields.at(emailColumn).size == 0) {
+        m_skipped++;
+        return false;
+    }
+
+    QString name = nameColumn >= 0 && nameColumn < fields.size() ? csvString(fields.at(nameColumn)) : QString();
+    personalization.to.append(EmailAddress(csvString(fields.at(emailColumn)), name));
+
+    if(subjectColumn >= 0 && subjectColumn < fields.size()) personalization.subject = csvString(fields.at(subjectColumn));
+
+    for(int i = 0; i < fields.size() && i < columns.size(); i++)
+    {
+        if(i == emailColumn || i == nameColumn || i == subjectColumn) continue;
+
+        personalization.substitutions.insert(columns.at(i), csvString(fields.at(i)));
+    }
+
+    return true;
+}
+
+const char *RecipientReader::parseJsonRecord(const char *p, const char *end, bool atEnd)
+{
+    const char *newline = static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+
+    if(newline) return newline + 1;
+
+    return atEnd ? end : nullptr;
+}
+
+// a string, or the raw text of a number or literal. null gives a null string
+static bool scanValue(const char *&p, const char *end, QString &value)
+{
+    if(p >= end) return false;
+
+    if(*p == '"')
+    {
+        const char *data;
+        int size;
+        bool escaped;
+
+        if(!scanString(p, end, data, size, escaped)) return false;
+
+        value = decodeString(data, size, escaped);
+        return true;
+    }
+
+    const char *start = p;
+    while(p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+
+    if(p == start) return false;
+
+    if(p - start == 4 && std::memcmp(start, "null", 4) == 0) value = QString();
+    else value = QString::fromLatin1(start, int(p - start));
+
+    return true;
+}
+
+// a flat object of string values into hash
+static bool scanObject(const char *&p, const char *end, QHash<QString, QString> &hash)
+{
+    p++; // '{'
+    skipSpace(p, end);
+
+    if(p < end && *p == '}') {
+        p++;
+        return true;
+    }
+
+    while(p < end)
+    {
+        const char *key;
+        int keySize;
+        bool keyEscaped;
+        QString value;
+
+        skipSpace(p, end);
+        if(p >= end || *p != '"' || !scanString(p, end, key, keySize, keyEscaped)) return false;
+
+        skipSpace(p, end);
+        if(p >= end || *p != ':') return false;
+        p++;
+        skipSpace(p, end);
+
+        if(!scanValue(p, end, value)) return false;
+        if(!value.isNull()) hash.insert(decodeString(key, keySize, keyEscaped), value);
+
+        skipSpace(p, end);
+        if(p < end && *p == ',') { p++; continue; }
+        if(p < end && *p == '}') { p++; return true; }
+
+        return false;
+    }
+
+    return false;
+}
+
+bool RecipientReader::jsonPersonalization(const char *p, const char *end, Personalization &personalization)
+{
+    skipSpace(p, end);
+
+    // blank line
+    if(p == end) return false;
+
+    QString email;
+    QString name;
+
+    if(*p != '{') {
+        m_skipped++;
+        return false;
+    }
+
+    p++;
+    skipSpace(p, end);
+
+    bool valid = p < end;
+
+    while(valid && *p != '}')
+    {
+        const char *key;
+        int keySize;
+        bool keyEscaped;
+
+        valid = *p == '"' && scanString(p, end, key, keySize, keyEscaped);
+        if(!valid) break;
+
+        skipSpace(p, end);
+        valid = p < end && *p == ':';
+        if(!valid) break;
+
+        p++;
+        skipSpace(p, end);
+
+        if(p < end && *p == '{')
+        {
+            if(keyIs(key, keySize, "substitutions")) valid = scanObject(p, end, personalization.substitutions);
+            else if(keyIs(key, keySize, "custom_args")) valid = scanObject(p, end, personalization.customArgs);
+            else valid = false;
+        }
+        else
+        {
+            QString value;
+            valid = scanValue(p, end, value);
+
+            if(valid && !value.isNull())
+            {
+                if(keyIs(key, keySize, "email")) email = value;
+                else if(keyIs(key, keySize, "name")) name = value;
+                else if(keyIs(key, keySize, "subject")) personalization.subject = value;
+                else personalization.substitutions.insert(tagFormat.arg(decodeString(key, keySize, keyEscaped)), value);
+            }
+        }
+
+        if(!valid) break;
+
+        skipSpace(p, end);
+        if(p < end && *p == ',') {
+            p++;
+            skipSpace(p, end);
+        }
+
+        valid = p < end;
+    }
+
+    if(!valid || email.isEmpty()) {
+        m_skipped++;
+        return false;
+    }
+
+    personalization.to.append(EmailAddress(email, name));
+
+    return true;
+}
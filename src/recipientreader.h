@@ -0,0 +1,88 @@
+#ifndef RECIPIENTREADER_H
+#define RECIPIENTREADER_H
+
+#include "sendgrid/sendgrid.h"
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <functional>
+
+namespace SendGrid {
+
+// streams recipients out of a CSV or JSON lines file in personalization batches.
+// the file is memory mapped a window at a time and parsed in place, only the
+// strings that end up in a Personalization are allocated, so memory stays flat
+// however long the list is.
+//
+// CSV needs a header row, the email, name and subject columns fill the
+// personalization and every other column becomes a substitution. JSON lines
+// are flat objects with the same keys, plus optional substitutions and
+// custom_args objects taken as they are
+class RecipientReader
+{
+public:
+    enum Format
+    {
+        Csv,
+        JsonLines
+    };
+
+    // consumer gets every full batch and the last partial one, returning false stops reading
+    using Consumer = std::function<bool(QList<Personalization> &batch)>;
+
+    RecipientReader(QString file, Format format = Csv);
+
+    void setBatchSize(int size);
+
+    // turns column names into substitution tags, %1 is the column name, e.g. "-%1-"
+    void setTagFormat(QString format);
+
+    bool read(Consumer consumer);
+
+    qint64 rows();
+    qint64 skipped();
+    QString errorString();
+
+private:
+    // a field in the mapped file, escaped when it holds "" or \ escapes to undo
+    struct Field
+    {
+        const char *data;
+        int size;
+        bool escaped;
+    };
+
+    // each returns where the next record starts, or nullptr when the record
+    // is not complete before end
+    const char *parseCsvRecord(const char *p, const char *end, bool atEnd);
+    const char *parseJsonRecord(const char *p, const char *end, bool atEnd);
+
+    void csvHeader();
+    bool csvPersonalization(Personalization &personalization);
+    bool jsonPersonalization(const char *p, const char *end, Personalization &personalization);
+
+    static QString csvString(const Field &field);
+
+    static const qint64 WindowSize = 32 * 1024 * 1024;
+
+    QString file;
+    Format format;
+    int batchSize = 1000;
+    QString tagFormat = "%1";
+
+    QVector<Field> fields;
+    bool haveHeader = false;
+    QStringList columns;
+    int emailColumn = -1;
+    int nameColumn = -1;
+    int subjectColumn = -1;
+
+    qint64 m_rows = 0;
+    qint64 m_skipped = 0;
+    QString m_error;
+};
+
+}
+#endif // RECIPIENTREADER_H
@@ -1,11 +1,28 @@
 #include "restconsumer.h"
 
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QSaveFile>
+#include <QTimer>
+
+#include <algorithm>
+#include <limits>
+
 using namespace Gurra;
 
-RestConsumer::RestConsumer()
+RestConsumer::RestConsumer():
+    deadlines {QDateTime::currentMSecsSinceEpoch() / DeadlineTick}
 {
     connect(&networkAccessManager, &QNetworkAccessManager::finished,
             this, &RestConsumer::parseNetworkResponse);
+
+    deadlineTimer.setInterval(DeadlineTick);
+    connect(&deadlineTimer, &QTimer::timeout, this, &RestConsumer::expireDeadlines);
+
+    throttleTimer.setSingleShot(true);
+    connect(&throttleTimer, &QTimer::timeout, this, &RestConsumer::releaseThrottled);
 }
 
 RestConsumer::~RestConsumer()
@@ -19,15 +36,30 @@ QByteArray RestConsumer::host(){
 
 void RestConsumer::setHost(QByteArray host){
     m_host = host;
+    rebuildEndpoints();
     hostChanged(host);
 }
 
 void RestConsumer::addHeader(QByteArray key, QByteArray value){
     headers.insert(key, value);
+    rebuildEndpoints();
 }
 
 void RestConsumer::addHeaders(QHash<QByteArray, QByteArray> headers){
     this->headers.unite(headers);
+    rebuildEndpoints();
+}
+
+void RestConsumer::registerEndpoint(QByteArray resource, QHash<QString, QString> query)
+{
+    endpointQueries.insert(resource, query);
+    endpoints.insert(resource, buildRequest(resource, query));
+}
+
+void RestConsumer::rebuildEndpoints()
+{
+    for(auto it = endpointQueries.constBegin(); it != endpointQueries.constEnd(); ++it)
+        endpoints.insert(it.key(), buildRequest(it.key(), it.value()));
 }
 
 void RestConsumer::addHeaders(QByteArray headers)
@@ -40,6 +72,8 @@ void RestConsumer::addHeaders(QByteArray headers)
             QByteArrayList h = str.split('=');
             if(h.size() == 2) this->headers.insert(h[0].trimmed(), h[1].trimmed());
         }
+
+        rebuildEndpoints();
     }
 }
 
@@ -64,7 +98,8 @@ void RestConsumer::setQueryParams(QUrl &url, QHash<QString, QString> params){
 
     QUrlQuery query;
 
-    for(QString p : params) query.addQueryItem(p, params.value(p));
+    for(auto it = params.constBegin(); it != params.constEnd(); ++it)
+        query.addQueryItem(it.key(), it.value());
 
     url.setQuery(query);
 }
@@ -72,8 +107,31 @@ void RestConsumer::setQueryParams(QUrl &url, QHash<QString, QString> params){
 
 void RestConsumer::setHeaders(QNetworkRequest &request)
 {
-    for(QByteArray h : headers.keys())
-        request.setRawHeader(h, headers.value(h));
+    for(auto it = headers.constBegin(); it != headers.constEnd(); ++it)
+        request.setRawHeader(it.key(), it.value());
+}
+
+QNetworkRequest RestConsumer::buildRequest(const QByteArray &resource, const QHash<QString, QString> &query)
+{
+    QUrl url(m_host + resource);
+
+    if(!query.isEmpty()) setQueryParams(url, query);
+
+    QNetworkRequest request (url);
+    setHeaders(request);
+
+    return request;
+}
+
+QNetworkRequest RestConsumer::makeRequest(const QByteArray &resource, const QHash<QString, QString> &query)
+{
+    // QNetworkRequest is implicitly shared, copying the prototype is just a ref count
+    if(query.isEmpty()) {
+        auto it = endpoints.constFind(resource);
+        if(it != endpoints.constEnd()) return it.value();
+    }
+
+    return buildRequest(resource, query);
 }
 
 void RestConsumer::parseNetworkResponse(QNetworkReply *reply){
@@ -81,29 +139,357 @@ void RestConsumer::parseNetworkResponse(QNetworkReply *reply){
     QByteArray data = reply->readAll();
     reply->deleteLater();
 
-    if(reply->error() != QNetworkReply::NoError)
+    inspectReply(reply);
+
+    RestResponse response;
+    response.networkError = reply->error();
+    response.statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    response.data = data;
+
+    // aborted at its deadline, told apart from a failure of the server
+    if(expired.remove(reply)) {
+        response.networkError = QNetworkReply::TimeoutError;
+        response.timedOut = true;
+    }
+    else if(replyDeadlines.contains(reply)) {
+        expiring.remove(replyDeadlines.take(reply));
+    }
+
+    auto pending = pendingCache.find(reply);
+
+    if(pending != pendingCache.end())
+    {
+        PendingCache cached = pending.value();
+        pendingCache.erase(pending);
+
+        bool store = true;
+        qint64 until = freshUntil(reply, store);
+
+        if(response.statusCode == 304 && cached.revalidating)
+        {
+            // unchanged, answer with what we have and keep it for another while
+            cached.entry.freshUntil = until;
+            if(reply->hasRawHeader("ETag")) cached.entry.etag = reply->rawHeader("ETag");
+
+            response.networkError = QNetworkReply::NoError;
+            response.statusCode = cached.entry.statusCode;
+            response.data = cached.entry.data;
+
+            if(store) storeCached(cached.key, cached.entry);
+        }
+        else if(response.isSuccess() && store)
+        {
+            CacheEntry entry;
+            entry.data = data;
+            entry.etag = reply->rawHeader("ETag");
+            entry.statusCode = response.statusCode;
+            entry.freshUntil = until;
+
+            // without an ETag a stale entry can't be revalidated, no use keeping it
+            if(until > QDateTime::currentMSecsSinceEpoch() || !entry.etag.isEmpty()) storeCached(cached.key, entry);
+        }
+    }
+    else if(cacheEnabled && reply->operation() != QNetworkAccessManager::GetOperation && response.isSuccess())
+    {
+        dropCached(reply->url());
+    }
+
+    auto outcome = issued.find(reply);
+
+    if(outcome != issued.end())
+    {
+        IssuedRequest request = outcome.value();
+        issued.erase(outcome);
+
+        // client errors say nothing about the server's health, overload does
+        bool failed = response.statusCode >= 500 || response.statusCode == 429
+                || (response.statusCode == 0 && response.networkError != QNetworkReply::NoError);
+        bool slow = QDateTime::currentMSecsSinceEpoch() - request.started > breaker.slowCall;
+
+        record(request.host, failed, slow);
+        if(request.endpoint != request.host) record(request.endpoint, failed, slow);
+    }
+
+    auto lane = replyLanes.find(reply);
+
+    if(lane != replyLanes.end()) {
+        lanes[lane.value()].inFlight--;
+        m_inFlight--;
+        replyLanes.erase(lane);
+    }
+
+    // requests issued with a handler report to it instead of the signals
+    deliver(reply->operation(), response, handlers.take(reply));
+
+    schedule();
+}
+
+void RestConsumer::deliver(QNetworkAccessManager::Operation operation, const RestResponse &response, RestHandler handler)
+{
+    if(handler) handler(response);
+    else emitResponse(operation, response);
+}
+
+void RestConsumer::setCacheEnabled(bool enable, int maxBytes, QString directory)
+{
+    cacheEnabled = enable;
+    cacheDirectory = directory;
+    cache.setMaxCost(maxBytes);
+
+    if(!enable) cache.clear();
+    if(enable && !directory.isEmpty()) QDir().mkpath(directory);
+
+    // files left by an earlier run count against the limits
+    countDiskCache();
+    trimDiskCache();
+}
+
+void RestConsumer::setDiskCacheLimits(qint64 maxBytes, int maxEntries)
+{
+    maxDiskBytes = qMax<qint64>(0, maxBytes);
+    maxDiskEntries = qMax(0, maxEntries);
+
+    trimDiskCache();
+}
+
+void RestConsumer::clearCache()
+{
+    cache.clear();
+
+    if(cacheDirectory.isEmpty()) return;
+
+    QDir dir(cacheDirectory);
+    for(const QString &file : dir.entryList({"*.cache"}, QDir::Files)) dir.remove(file);
+
+    countDiskCache();
+}
+
+void RestConsumer::countDiskCache()
+{
+    diskBytes = 0;
+    diskEntries = 0;
+
+    if(cacheDirectory.isEmpty()) return;
+
+    for(const QFileInfo &info : QDir(cacheDirectory).entryInfoList({"*.cache"}, QDir::Files)) {
+        diskBytes += info.size();
+        diskEntries++;
+    }
+}
+
+void RestConsumer::trimDiskCache()
+{
+    bool overBytes = maxDiskBytes > 0 && diskBytes > maxDiskBytes;
+    bool overEntries = maxDiskEntries > 0 && diskEntries > maxDiskEntries;
+
+    if(cacheDirectory.isEmpty() || (!overBytes && !overEntries)) return;
+
+    QDir dir(cacheDirectory);
+    QFileInfoList files = dir.entryInfoList({"*.cache"}, QDir::Files, QDir::Time | QDir::Reversed);
+
+    countDiskCache();
+
+    // down to 90%, so the stores that follow don't list the directory again
+    for(const QFileInfo &info : files)
+    {
+        if((maxDiskBytes <= 0 || diskBytes <= maxDiskBytes / 10 * 9)
+                && (maxDiskEntries <= 0 || diskEntries <= maxDiskEntries / 10 * 9)) break;
+
+        if(dir.remove(info.fileName())) {
+            diskBytes -= info.size();
+            diskEntries--;
+        }
+    }
+}
+
+// keys start with a hash of the url path so everything cached for a path can be found
+static QByteArray pathKey(const QUrl &url)
+{
+    return QCryptographicHash::hash(url.adjusted(QUrl::RemoveQuery | QUrl::RemoveFragment).toEncoded(),
+                                    QCryptographicHash::Sha1).toHex().left(16);
+}
+
+QByteArray RestConsumer::cacheKey(const QNetworkRequest &request)
+{
+    QCryptographicHash variant(QCryptographicHash::Sha1);
+    variant.addData(request.url().query(QUrl::FullyEncoded).toUtf8());
+
+    // the headers as sent, after prepareRequest(), so the Authorization and
+    // On-Behalf-Of a key pool picked keep subusers apart. only the hash is kept
+    QList<QByteArray> names = request.rawHeaderList();
+    std::sort(names.begin(), names.end());
+
+    for(const QByteArray &name : names) variant.addData(name + ':' + request.rawHeader(name) + '\n');
+
+    return pathKey(request.url()) + '-' + variant.result().toHex().left(16);
+}
+
+QString RestConsumer::cacheFile(const QByteArray &key)
+{
+    return cacheDirectory + '/' + QString::fromLatin1(key) + ".cache";
+}
+
+bool RestConsumer::findCached(const QByteArray &key, CacheEntry &entry)
+{
+    if(CacheEntry *cached = cache.object(key)) {
+        entry = *cached;
+        return true;
+    }
+
+    if(cacheDirectory.isEmpty()) return false;
+
+    QFile file(cacheFile(key));
+    if(!file.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> entry.etag >> entry.statusCode >> entry.freshUntil >> entry.data;
+
+    if(stream.status() != QDataStream::Ok) return false;
+
+    cache.insert(key, new CacheEntry(entry), qMax(1, entry.data.size()));
+
+    return true;
+}
+
+void RestConsumer::storeCached(const QByteArray &key, const CacheEntry &entry)
+{
+    // an entry larger than the whole memory tier is refused by QCache
+    cache.insert(key, new CacheEntry(entry), qMax(1, entry.data.size()));
+
+    if(cacheDirectory.isEmpty()) return;
+
+    QString path = cacheFile(key);
+    QFileInfo previous(path);
+
+    QSaveFile file(path);
+    if(!file.open(QIODevice::WriteOnly)) return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << entry.etag << entry.statusCode << entry.freshUntil << entry.data;
+
+    qint64 size = file.size();
+    if(!file.commit()) return;
+
+    if(previous.exists()) diskBytes -= previous.size();
+    else diskEntries++;
+
+    diskBytes += size;
+
+    trimDiskCache();
+}
+
+void RestConsumer::dropCached(const QUrl &url)
+{
+    // the resource itself and the collections above it, a change to
+    // /templates/x also changes what /templates lists
+    QUrl path = url.adjusted(QUrl::RemoveQuery | QUrl::RemoveFragment | QUrl::StripTrailingSlash);
+    QByteArrayList prefixes;
+
+    while(path.path().size() > 1)
+    {
+        prefixes.append(pathKey(path) + '-');
+        path = path.adjusted(QUrl::RemoveFilename | QUrl::StripTrailingSlash);
+    }
+
+    for(const QByteArray &key : cache.keys())
+    {
+        for(const QByteArray &prefix : prefixes)
+        {
+            if(key.startsWith(prefix)) {
+                cache.remove(key);
+                break;
+            }
+        }
+    }
+
+    if(cacheDirectory.isEmpty()) return;
+
+    QDir dir(cacheDirectory);
+
+    for(const QByteArray &prefix : prefixes)
+    {
+        for(const QFileInfo &info : dir.entryInfoList({QString::fromLatin1(prefix) + "*.cache"}, QDir::Files))
+        {
+            if(dir.remove(info.fileName())) {
+                diskBytes -= info.size();
+                diskEntries--;
+            }
+        }
+    }
+}
+
+qint64 RestConsumer::freshUntil(QNetworkReply *reply, bool &store)
+{
+    qint64 maxAge = 0;
+    bool noCache = false;
+
+    for(QByteArray directive : reply->rawHeader("Cache-Control").toLower().split(','))
+    {
+        directive = directive.trimmed();
+
+        if(directive == "no-store") store = false;
+        else if(directive == "no-cache") noCache = true;
+        else if(directive.startsWith("max-age=")) maxAge = directive.mid(8).toLongLong();
+    }
+
+    if(noCache) maxAge = 0;
+
+    return QDateTime::currentMSecsSinceEpoch() + maxAge * 1000;
+}
+
+void RestConsumer::prepareRequest(QNetworkRequest &request)
+{
+    Q_UNUSED(request)
+}
+
+void RestConsumer::inspectReply(QNetworkReply *reply)
+{
+    Q_UNUSED(reply)
+}
+
+int RestConsumer::throttle(QNetworkRequest &request)
+{
+    Q_UNUSED(request)
+    return 0;
+}
+
+void RestConsumer::emitResponse(QNetworkAccessManager::Operation operation, const RestResponse &response)
+{
+    const QByteArray &data = response.data;
+
+    if(response.timedOut) {
+        emit timedOut();
+        return;
+    }
+
+    if(!response.error.isEmpty()) {
+        emit error(response.error);
+        return;
+    }
+
+    if(response.networkError != QNetworkReply::NoError)
     {
         // usually server returns an error object describing the error
         // if no error object returned, the means there is error connecting to server
         if(data.isEmpty())
-            emit networkError(reply->error());
+            emit networkError(response.networkError);
         else
             emit serverError(data);
 
         return;
     }
 
-    int statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-
     // usually server returns an error in json doc with more details about error
-    // that can be parsed from data
-    if(statusCode != 200) {
+    // that can be parsed from data, any 2xx is a success (mail/send answers 202)
+    if(response.statusCode < 200 || response.statusCode > 299) {
 
         emit serverError(data);
         return;
     }
 
-    switch (reply->operation()){
+    switch (operation){
     case QNetworkAccessManager::GetOperation:
         emit ready(data);
         break;
@@ -116,7 +502,522 @@ void RestConsumer::parseNetworkResponse(QNetworkReply *reply){
     case QNetworkAccessManager::DeleteOperation:
         emit deleted(data);
         break;
+    default:
+        break;
+    }
+}
+
+void RestConsumer::setMaxInFlight(int maxInFlight)
+{
+    this->maxInFlight = qMax(0, maxInFlight);
+    schedule();
+}
+
+void RestConsumer::setLane(RestPriority priority, int weight, int reserved)
+{
+    lanes[priority].weight = qMax(1, weight);
+    lanes[priority].reserved = qMax(0, reserved);
+    schedule();
+}
+
+int RestConsumer::inFlight(){
+    return m_inFlight;
+}
+
+int RestConsumer::queued(RestPriority priority){
+    return lanes[priority].queue.size();
+}
+
+void RestConsumer::send(QNetworkAccessManager::Operation operation, const QByteArray &resource, const QByteArray &data,
+                        const QHash<QString, QString> &query, RestHandler handler, RestPriority priority, qint64 deadline)
+{
+    // timeouts count from when the request was sent here, before any queue, so
+    // waiting in a lane, for a circuit or for throttle() is part of the limit.
+    // a deadline from the caller may be earlier and is never extended
+    int limit = resourceTimeouts.value(resource, defaultTimeout);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    if(limit > 0 && (!deadline || now + limit < deadline)) deadline = now + limit;
+
+    if(maxInFlight <= 0) {
+        issue(operation, resource, data, query, handler, priority, deadline);
+        return;
     }
+
+    Lane &lane = lanes[priority];
+
+    // a lane that sat idle starts level with the others, the turns it skipped don't add up
+    if(lane.queue.isEmpty()) lane.pass = qMax(lane.pass, virtualTime);
+
+    lane.queue.enqueue({operation, resource, data, query, handler, deadline});
+    if(deadline) watchDeadline(deadline, QueuedDeadline);
+
+    schedule();
+}
+
+void RestConsumer::schedule()
+{
+    forever
+    {
+        if(maxInFlight > 0 && m_inFlight >= maxInFlight) return;
+
+        // reserved slots their lanes aren't using, only those lanes may fill them
+        int unused = 0;
+        for(const Lane &lane : lanes) unused += qMax(0, lane.reserved - lane.inFlight);
+
+        int next = -1;
+
+        for(int i = 0; i < Lanes; i++)
+        {
+            const Lane &lane = lanes[i];
+
+            // a lane keeps its order while a throttled request of it waits
+            if(lane.queue.isEmpty() || !lane.throttled.isEmpty()) continue;
+
+            int own = qMax(0, lane.reserved - lane.inFlight);
+            if(maxInFlight > 0 && maxInFlight - m_inFlight <= unused - own) continue;
+
+            // ties go to the higher priority
+            if(next < 0 || lane.pass < lanes[next].pass) next = i;
+        }
+
+        if(next < 0) return;
+
+        Lane &lane = lanes[next];
+        virtualTime = lane.pass;
+        lane.pass += Stride / lane.weight;
+
+        QueuedRequest request = lane.queue.dequeue();
+        QNetworkReply *reply = issue(request.operation, request.resource, request.data, request.query, request.handler,
+                                     RestPriority(next), request.deadline);
+
+        // deferred, the lane gets its turn back when it is offered again
+        if(!lane.throttled.isEmpty()) lane.pass -= Stride / lane.weight;
+
+        // without a limit nothing is counted, the lanes just drain
+        if(reply && maxInFlight > 0) {
+            lane.inFlight++;
+            m_inFlight++;
+            replyLanes.insert(reply, next);
+        }
+    }
+}
+
+void RestConsumer::setCircuitBreakerEnabled(bool enable, CircuitBreakerSettings settings)
+{
+    breakerEnabled = enable;
+    breaker = settings;
+
+    if(enable) return;
+
+    circuits.clear();
+    issued.clear();
+    releaseHeld();
+}
+
+CircuitState RestConsumer::circuitState(QByteArray resource)
+{
+    CircuitState host = circuits.value(m_host).state;
+    if(host != CircuitClosed) return host;
+
+    return circuits.value(m_host + route(resource)).state;
+}
+
+// the resource with ids taken out, /templates/d-1f2e and /templates/d-9a8b share
+// a circuit, and circuits don't pile up for every id ever requested. a segment
+// is an id if it has a digit or an @ in it, or is too long to be a name
+QByteArray RestConsumer::route(const QByteArray &resource)
+{
+    QByteArray normalized;
+    normalized.reserve(resource.size());
+
+    int end = resource.indexOf('?');
+    if(end < 0) end = resource.size();
+
+    for(int begin = 0; begin < end;)
+    {
+        int next = resource.indexOf('/', begin + 1);
+        if(next < 0 || next > end) next = end;
+
+        bool id = next - begin > 33;
+
+        for(int i = begin; i < next && !id; i++) id = (resource.at(i) >= '0' && resource.at(i) <= '9') || resource.at(i) == '@';
+
+        if(id) normalized += resource.at(begin) == '/' ? "/:id" : ":id";
+        else normalized += resource.mid(begin, next - begin);
+
+        begin = next;
+    }
+
+    return normalized;
+}
+
+bool RestConsumer::admit(const QByteArray &endpoint)
+{
+    // both inserted first, so the references taken next stay valid
+    circuits[m_host];
+    circuits[endpoint];
+
+    Circuit &host = circuits[m_host];
+    Circuit &path = circuits[endpoint];
+
+    for(const Circuit *circuit : {&host, &path})
+    {
+        if(circuit->state == CircuitOpen) return false;
+        if(circuit->state == CircuitHalfOpen && circuit->probing >= breaker.probes) return false;
+    }
+
+    return true;
+}
+
+void RestConsumer::probe(const QByteArray &endpoint)
+{
+    // counted once the request actually goes, admit() created both
+    Circuit &host = circuits[m_host];
+    Circuit &path = circuits[endpoint];
+
+    if(host.state == CircuitHalfOpen) host.probing++;
+    if(path.state == CircuitHalfOpen && &path != &host) path.probing++;
+}
+
+void RestConsumer::record(const QByteArray &key, bool failed, bool slow)
+{
+    auto it = circuits.find(key);
+    if(it == circuits.end()) return;
+
+    Circuit &circuit = it.value();
+
+    // replies to requests sent before it opened
+    if(circuit.state == CircuitOpen) return;
+
+    if(circuit.state == CircuitHalfOpen)
+    {
+        if(failed || slow) setCircuitState(key, CircuitOpen);
+        else if(++circuit.probed >= breaker.probes) setCircuitState(key, CircuitClosed);
+
+        return;
+    }
+
+    qint64 span = qMax(1, breaker.window / Buckets);
+    qint64 tick = QDateTime::currentMSecsSinceEpoch() / span;
+    int i = int(tick % Buckets);
+
+    if(circuit.bucket[i] != tick) {
+        circuit.bucket[i] = tick;
+        circuit.requests[i] = circuit.failures[i] = circuit.slow[i] = 0;
+    }
+
+    circuit.requests[i]++;
+    circuit.failures[i] += failed;
+    circuit.slow[i] += slow;
+
+    int requests = 0, failures = 0, slowCalls = 0;
+
+    for(int j = 0; j < Buckets; j++)
+    {
+        if(tick - circuit.bucket[j] >= Buckets) continue;
+
+        requests += circuit.requests[j];
+        failures += circuit.failures[j];
+        slowCalls += circuit.slow[j];
+    }
+
+    if(requests >= breaker.minimumRequests
+            && (failures >= breaker.failureRate * requests || slowCalls >= breaker.slowRate * requests))
+        setCircuitState(key, CircuitOpen);
+}
+
+void RestConsumer::setCircuitState(const QByteArray &key, CircuitState state)
+{
+    Circuit circuit;
+    circuit.state = state;
+    circuits.insert(key, circuit);
+
+    emit circuitChanged(key, state);
+
+    if(state == CircuitOpen)
+    {
+        QTimer::singleShot(breaker.openDuration, this, [this, key]{
+            auto it = circuits.constFind(key);
+            if(it != circuits.constEnd() && it->state == CircuitOpen) setCircuitState(key, CircuitHalfOpen);
+        });
+
+        return;
+    }
+
+    // held requests go again, those still refused are held again in order
+    QMetaObject::invokeMethod(this, [this]{ releaseHeld(); }, Qt::QueuedConnection);
+}
+
+void RestConsumer::releaseHeld()
+{
+    QQueue<HeldRequest> waiting;
+    waiting.swap(held);
+
+    for(const HeldRequest &h : waiting)
+        send(h.request.operation, h.request.resource, h.request.data, h.request.query, h.request.handler, h.priority, h.request.deadline);
+}
+
+void RestConsumer::releaseThrottled()
+{
+    for(int i = 0; i < Lanes; i++)
+    {
+        Lane &lane = lanes[i];
+
+        QQueue<QueuedRequest> waiting;
+        waiting.swap(lane.throttled);
+
+        if(waiting.isEmpty()) continue;
+
+        // with a limit they go back to the front of their lane and take a slot
+        // through schedule() like any other
+        if(maxInFlight > 0)
+        {
+            if(lane.queue.isEmpty()) lane.pass = qMax(lane.pass, virtualTime);
+
+            waiting.append(lane.queue);
+            lane.queue.swap(waiting);
+            continue;
+        }
+
+        while(!waiting.isEmpty())
+        {
+            // one deferred again keeps the rest waiting behind it
+            if(!lane.throttled.isEmpty()) {
+                lane.throttled.append(waiting);
+                break;
+            }
+
+            QueuedRequest request = waiting.dequeue();
+            issue(request.operation, request.resource, request.data, request.query, request.handler,
+                  RestPriority(i), request.deadline);
+        }
+    }
+
+    schedule();
+}
+
+void RestConsumer::setTimeout(int milliseconds){
+    defaultTimeout = qMax(0, milliseconds);
+}
+
+void RestConsumer::setTimeout(QByteArray resource, int milliseconds)
+{
+    if(milliseconds > 0) resourceTimeouts.insert(resource, milliseconds);
+    else resourceTimeouts.remove(resource);
+}
+
+qint64 RestConsumer::remaining(qint64 deadline)
+{
+    if(!deadline) return std::numeric_limits<qint64>::max();
+
+    return deadline - QDateTime::currentMSecsSinceEpoch();
+}
+
+void RestConsumer::watchDeadline(qint64 deadline, quint64 id)
+{
+    // an idle wheel lags behind, catch it up before inserting relative to it
+    deadlines.reset(QDateTime::currentMSecsSinceEpoch() / DeadlineTick);
+
+    deadlines.insert((deadline + DeadlineTick - 1) / DeadlineTick, id);
+
+    if(!deadlineTimer.isActive()) deadlineTimer.start();
+}
+
+void RestConsumer::expireDeadlines()
+{
+    QList<QNetworkReply *> due;
+    bool queued = false;
+
+    deadlines.advance(QDateTime::currentMSecsSinceEpoch() / DeadlineTick, [this, &due, &queued](quint64 id){
+        if(id == QueuedDeadline) queued = true;
+        else if(QNetworkReply *reply = expiring.take(id)) due.append(reply);
+    });
+
+    if(deadlines.isEmpty()) deadlineTimer.stop();
+
+    if(queued) expireQueued();
+
+    // abort may finish the reply right away, so the wheel is left alone meanwhile
+    for(QNetworkReply *reply : due)
+    {
+        replyDeadlines.remove(reply);
+        expired.insert(reply);
+        reply->abort();
+    }
+}
+
+// a request that moved between queues may have left several entries, and one
+// that was sent since none that matter, so every queue is swept for what ran out
+void RestConsumer::expireQueued()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    bool removed = false;
+
+    auto lapsed = [this, now, &removed](const QueuedRequest &request){
+        if(!request.deadline || request.deadline > now) return false;
+
+        timeOut(request.operation, request.handler);
+        removed = true;
+
+        return true;
+    };
+
+    bool throttled = false;
+
+    for(Lane &lane : lanes)
+    {
+        lane.queue.erase(std::remove_if(lane.queue.begin(), lane.queue.end(), lapsed), lane.queue.end());
+        lane.throttled.erase(std::remove_if(lane.throttled.begin(), lane.throttled.end(), lapsed), lane.throttled.end());
+
+        throttled = throttled || !lane.throttled.isEmpty();
+    }
+
+    held.erase(std::remove_if(held.begin(), held.end(), [&lapsed](const HeldRequest &h){
+        return lapsed(h.request);
+    }), held.end());
+
+    if(!throttled) throttleTimer.stop();
+
+    // a lane may have been waiting behind a throttled request that is gone now
+    if(removed) schedule();
+}
+
+void RestConsumer::timeOut(QNetworkAccessManager::Operation operation, RestHandler handler)
+{
+    RestResponse response;
+    response.networkError = QNetworkReply::TimeoutError;
+    response.timedOut = true;
+    response.error = "deadline passed before the request was sent";
+
+    QMetaObject::invokeMethod(this, [this, operation, response, handler]{
+        deliver(operation, response, handler);
+    }, Qt::QueuedConnection);
+}
+
+QNetworkReply *RestConsumer::issue(QNetworkAccessManager::Operation operation, const QByteArray &resource, const QByteArray &data,
+                                   const QHash<QString, QString> &query, RestHandler handler, RestPriority priority,
+                                   qint64 deadline)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // the deadline already carries the timeouts, see send(). it ran out while
+    // waiting in a lane or in the holding queue, not worth sending
+    if(deadline && deadline <= now) {
+        timeOut(operation, handler);
+        return nullptr;
+    }
+
+    QNetworkRequest request = makeRequest(resource, query);
+    QNetworkReply *reply = nullptr;
+
+    prepareRequest(request);
+
+    PendingCache pending;
+
+    if(cacheEnabled && operation == QNetworkAccessManager::GetOperation)
+    {
+        pending.key = cacheKey(request);
+
+        if(findCached(pending.key, pending.entry))
+        {
+            if(pending.entry.freshUntil > QDateTime::currentMSecsSinceEpoch())
+            {
+                RestResponse response;
+                response.statusCode = pending.entry.statusCode;
+                response.data = pending.entry.data;
+
+                // still answered asynchronously, like a reply from the network
+                QMetaObject::invokeMethod(this, [this, response, handler]{
+                    deliver(QNetworkAccessManager::GetOperation, response, handler);
+                }, Qt::QueuedConnection);
+
+                return nullptr;
+            }
+
+            if(!pending.entry.etag.isEmpty()) {
+                request.setRawHeader("If-None-Match", pending.entry.etag);
+                pending.revalidating = true;
+            }
+        }
+    }
+
+    QByteArray endpoint = breakerEnabled ? m_host + route(resource) : QByteArray();
+
+    if(breakerEnabled && !admit(endpoint))
+    {
+        if(breaker.hold && held.size() < breaker.holdLimit) {
+            held.enqueue({{operation, resource, data, query, handler, deadline}, priority});
+            if(deadline) watchDeadline(deadline, QueuedDeadline);
+
+            return nullptr;
+        }
+
+        RestResponse response;
+        response.error = "circuit open for " + endpoint;
+
+        QMetaObject::invokeMethod(this, [this, operation, response, handler]{
+            deliver(operation, response, handler);
+        }, Qt::QueuedConnection);
+
+        return nullptr;
+    }
+
+    // the rate budget is only spent on requests that go on the network
+    int wait = 0;
+
+    QQueue<QueuedRequest> &throttled = lanes[priority].throttled;
+
+    if(!throttled.isEmpty() || (wait = throttle(request)) > 0)
+    {
+        throttled.enqueue({operation, resource, data, query, handler, deadline});
+        if(deadline) watchDeadline(deadline, QueuedDeadline);
+
+        // the earliest wait of any lane wakes them all
+        wait = qMax(1, wait);
+        if(!throttleTimer.isActive() || throttleTimer.remainingTime() > wait) throttleTimer.start(wait);
+
+        return nullptr;
+    }
+
+    if(breakerEnabled) probe(endpoint);
+
+    switch (operation) {
+    case QNetworkAccessManager::GetOperation:
+        qDebug() << "GET" << request.url().toString();
+        reply = networkAccessManager.get(request);
+        break;
+    case QNetworkAccessManager::PostOperation:
+        qDebug() << "POST" << request.url().toString();
+        reply = networkAccessManager.post(request, data);
+        break;
+    case QNetworkAccessManager::PutOperation:
+        qDebug() << "PUT" << request.url().toString();
+        reply = networkAccessManager.put(request, data);
+        break;
+    case QNetworkAccessManager::DeleteOperation:
+        qDebug() << "DELETE" << request.url().toString();
+        reply = networkAccessManager.deleteResource(request);
+        break;
+    default:
+        emit error("unsupported operation");
+        return nullptr;
+    }
+
+    if(handler) handlers.insert(reply, handler);
+    if(!pending.key.isEmpty()) pendingCache.insert(reply, pending);
+    if(breakerEnabled) issued.insert(reply, {m_host, endpoint, now});
+
+    if(deadline)
+    {
+        quint64 id = ++lastDeadline;
+
+        expiring.insert(id, reply);
+        replyDeadlines.insert(reply, id);
+        watchDeadline(deadline, id);
+    }
+
+    return reply;
 }
 
 void RestConsumer::get(QByteArray resource, QString query){
@@ -126,31 +1027,28 @@ void RestConsumer::get(QByteArray resource, QString query){
 
 void RestConsumer::get(QByteArray resource, QHash<QString, QString> query){
 
-    QUrl url( m_host + resource );
-
-    setQueryParams(url, query);
+    send(QNetworkAccessManager::GetOperation, resource, {}, query, nullptr);
+}
 
-    QNetworkRequest request (url);
-    setHeaders(request);
+void RestConsumer::get(QByteArray resource, RestHandler handler, QHash<QString, QString> query, RestPriority priority,
+                          qint64 deadline){
 
-    qDebug() << "GET" << url.toString();
-    networkAccessManager.get(request);
+    send(QNetworkAccessManager::GetOperation, resource, {}, query, handler, priority, deadline);
 }
+
 void RestConsumer::post(QByteArray resource, QByteArray data, QString query){
     post(resource, data, makeQueryParams(query));
 }
 
 void RestConsumer::post(QByteArray resource, QByteArray data, QHash<QString, QString> query){
 
-    QUrl url(m_host + resource);
-
-    setQueryParams(url, query);
+    send(QNetworkAccessManager::PostOperation, resource, data, query, nullptr);
+}
 
-    QNetworkRequest request (url);
-    setHeaders(request);
+void RestConsumer::post(QByteArray resource, QByteArray data, RestHandler handler, QHash<QString, QString> query, RestPriority priority,
+                          qint64 deadline){
 
-    qDebug() << "POST" << url.toString();
-    networkAccessManager.post(request, data);
+    send(QNetworkAccessManager::PostOperation, resource, data, query, handler, priority, deadline);
 }
 
 void RestConsumer::put(QByteArray resource, QByteArray data, QString query){
@@ -159,15 +1057,13 @@ void RestConsumer::put(QByteArray resource, QByteArray data, QString query){
 
 void RestConsumer::put(QByteArray resource, QByteArray data, QHash<QString, QString> query){
 
-    QUrl url(m_host + resource);
-
-    setQueryParams(url, query);
+    send(QNetworkAccessManager::PutOperation, resource, data, query, nullptr);
+}
 
-    QNetworkRequest request (url);
-    setHeaders(request);
+void RestConsumer::put(QByteArray resource, QByteArray data, RestHandler handler, QHash<QString, QString> query, RestPriority priority,
+                          qint64 deadline){
 
-    qDebug() << "PUT" << url.toString();
-    networkAccessManager.put(request, data);
+    send(QNetworkAccessManager::PutOperation, resource, data, query, handler, priority, deadline);
 }
 
 void RestConsumer::remove(QByteArray resource, QString query){
@@ -176,15 +1072,13 @@ void RestConsumer::remove(QByteArray resource, QString query){
 
 void RestConsumer::remove(QByteArray resource, QHash<QString, QString> query){
 
-    QUrl url(m_host + resource);
-
-    setQueryParams(url, query);
+    send(QNetworkAccessManager::DeleteOperation, resource, {}, query, nullptr);
+}
 
-    QNetworkRequest request (url);
-    setHeaders(request);
+void RestConsumer::remove(QByteArray resource, RestHandler handler, QHash<QString, QString> query, RestPriority priority,
+                          qint64 deadline){
 
-    qDebug() << "DELETE" << url.toString();
-    networkAccessManager.deleteResource(request);
+    send(QNetworkAccessManager::DeleteOperation, resource, {}, query, handler, priority, deadline);
 }
 
 void RestConsumer::upload(QByteArray resource, QUrl file, bool put)
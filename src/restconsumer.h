@@ -13,11 +13,74 @@
 #include <QHttpPart>
 #include <QFile>
 #include <QFileInfo>
+#include <QCache>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
+
+#include <functional>
 
 #include "mimetypes.h"
+#include "timingwheel.h"
 
 namespace Gurra {
 
+// outcome of a single request, handed to the handler it was issued with
+struct RestResponse
+{
+    QNetworkReply::NetworkError networkError = QNetworkReply::NoError;
+    int statusCode = 0;
+    QByteArray data;
+
+    // set when the request was refused before reaching the network
+    QByteArray error;
+
+    // the deadline passed, before the request was sent or while waiting for the reply
+    bool timedOut = false;
+
+    bool isSuccess() const {
+        return error.isEmpty() && networkError == QNetworkReply::NoError && statusCode >= 200 && statusCode < 300;
+    }
+};
+
+using RestHandler = std::function<void(const RestResponse &response)>;
+
+// when to stop sending to a host or endpoint that is failing, see setCircuitBreakerEnabled
+struct CircuitBreakerSettings
+{
+    // outcomes are counted over the last window ms, and judged once there are minimumRequests
+    int window = 10000;
+    int minimumRequests = 20;
+
+    // share of failed (no answer, 5xx or 429) or slow replies that opens the circuit
+    double failureRate = 0.5;
+    int slowCall = 5000;
+    double slowRate = 0.8;
+
+    // ms the circuit stays open, then probes requests are let through and it
+    // closes if they all succeed
+    int openDuration = 30000;
+    int probes = 3;
+
+    // while open, requests wait in a holding queue of up to holdLimit instead of failing at once
+    bool hold = false;
+    int holdLimit = 1000;
+};
+
+enum CircuitState
+{
+    CircuitClosed,
+    CircuitOpen,
+    CircuitHalfOpen
+};
+
+// lanes requests wait in while RestConsumer limits how many are in flight
+enum RestPriority
+{
+    HighPriority,
+    NormalPriority,
+    BulkPriority
+};
 
 class RestConsumer : public QObject
 {
@@ -37,6 +100,10 @@ public slots:
     void addHeader(QByteArray key, QByteArray value);
     void addHeaders(QHash<QByteArray, QByteArray> headers);
 
+    // builds the request for a fixed resource once, requests to it without
+    // an extra query reuse that prototype instead of rebuilding url and headers
+    void registerEndpoint(QByteArray resource, QHash<QString, QString> query = {});
+
     void get(QByteArray resource,  QString query = "");
     void get(QByteArray resource,  QHash<QString, QString> query);
 
@@ -52,6 +119,70 @@ public slots:
     void upload(QByteArray resource, QUrl file, bool put);
     void upload(QByteArray resource, QUrl file, QByteArray data, bool put);
 
+public:
+
+    // requests issued with a handler report their outcome to it only,
+    // none of the signals below are emitted for them. deadline is in ms since
+    // epoch, a request still waiting or unanswered then is aborted and reported
+    // with timedOut set
+    void get(QByteArray resource, RestHandler handler, QHash<QString, QString> query = {}, RestPriority priority = NormalPriority,
+              qint64 deadline = 0);
+    void post(QByteArray resource, QByteArray data, RestHandler handler, QHash<QString, QString> query = {}, RestPriority priority = NormalPriority,
+              qint64 deadline = 0);
+    void put(QByteArray resource, QByteArray data, RestHandler handler, QHash<QString, QString> query = {}, RestPriority priority = NormalPriority,
+              qint64 deadline = 0);
+    void remove(QByteArray resource, RestHandler handler, QHash<QString, QString> query = {}, RestPriority priority = NormalPriority,
+              qint64 deadline = 0);
+
+    // at most maxInFlight requests are on the network at once, the others wait in
+    // the lane of their priority. lanes take turns in proportion to their weight,
+    // first come first served within a lane, and the slots a lane reserves are
+    // kept free for it even while the other lanes are backed up. QNetworkAccessManager
+    // opens 6 connections per host and queues the rest in plain order, so a limit
+    // above that lets bulk requests get ahead again. 0, the default, sends every
+    // request as soon as it is issued
+    void setMaxInFlight(int maxInFlight);
+
+    // defaults are weights 8, 4 and 1 from high to bulk, with nothing reserved.
+    // reservations should leave some slots to the lanes without one
+    void setLane(RestPriority priority, int weight, int reserved = 0);
+
+    int inFlight();
+    int queued(RestPriority priority);
+
+    // ms a request may take from being issued to its reply, for every request and for
+    // the requests to one resource, the earliest of these and its own deadline applies.
+    // 0 removes the limit. expiry is checked every DeadlineTick ms, also for requests
+    // still waiting in a lane, for a circuit or for throttle()
+    void setTimeout(int milliseconds);
+    void setTimeout(QByteArray resource, int milliseconds);
+
+    // ms left until deadline, negative once it passed. without a deadline there is no limit
+    static qint64 remaining(qint64 deadline);
+
+    enum { DeadlineTick = 50 };
+
+    // keeps a circuit per host and one per route, the resource with the ids in its
+    // path taken out. a circuit opens when too many of its recent replies fail or
+    // are slow, and then refuses requests at once with an error, or holds them
+    // until it closes, instead of piling them onto a server that can't cope
+    void setCircuitBreakerEnabled(bool enable, CircuitBreakerSettings settings = CircuitBreakerSettings());
+    CircuitState circuitState(QByteArray resource);
+
+    // answers repeated GETs from a local cache, off by default. entries are kept
+    // as long as Cache-Control allows and revalidated with If-None-Match after
+    // that, a 304 is answered with the cached body. maxBytes bounds the memory
+    // tier, least recently used entries are evicted first. with a directory
+    // entries are also written to disk and found there after being evicted.
+    // a successful POST, PUT or DELETE drops the cached GETs of its url. entries
+    // are kept apart by every header sent, credentials included, so accounts and
+    // subusers never see each other's
+    void setCacheEnabled(bool enable, int maxBytes = 8 * 1024 * 1024, QString directory = {});
+    void clearCache();
+
+    // bounds the disk tier, the oldest written files go first. 0 is no bound
+    void setDiskCacheLimits(qint64 maxBytes, int maxEntries);
+
 signals:
 
     void ready(const QByteArray rawData);
@@ -69,20 +200,207 @@ signals:
 
     void hostChanged(QByteArray host);
 
+    // a request issued without a handler ran out of time
+    void timedOut();
+
+    // circuit is the host, or the host and route
+    void circuitChanged(const QByteArray circuit, CircuitState state);
+
+protected:
+    // emits the signals matching the outcome of a request
+    void emitResponse(QNetworkAccessManager::Operation operation, const RestResponse &response);
+
+    // called for every request before it is issued, and for every reply before it
+    // is handed on, subclasses may adjust the request or learn from the reply
+    virtual void prepareRequest(QNetworkRequest &request);
+    virtual void inspectReply(QNetworkReply *reply);
+
+    // called once a request is about to go on the network, after the cache and the
+    // circuit breaker let it through. returns 0 to send it, or the ms to wait before
+    // it is tried again, requests issued meanwhile wait behind it in order
+    virtual int throttle(QNetworkRequest &request);
+
 private slots:
     void parseNetworkResponse(QNetworkReply *reply );
 
 private:
+    struct CacheEntry
+    {
+        QByteArray data;
+        QByteArray etag;
+        int statusCode = 0;
+
+        // ms since epoch, the entry is used without asking the server until then
+        qint64 freshUntil = 0;
+    };
+
+    // a GET that went to the network with a cache key, and the stale entry it revalidates
+    struct PendingCache
+    {
+        QByteArray key;
+        bool revalidating = false;
+        CacheEntry entry;
+    };
+
+    // a request waiting in its lane for a slot
+    struct QueuedRequest
+    {
+        QNetworkAccessManager::Operation operation;
+        QByteArray resource;
+        QByteArray data;
+        QHash<QString, QString> query;
+        RestHandler handler;
+        qint64 deadline;
+    };
+
+    // stride scheduling, the waiting lane with the lowest pass goes next and
+    // advances it by Stride / weight, so lanes are served in proportion to weight.
+    // requests throttle() deferred wait in their own lane, which is skipped until
+    // throttleTimer offers them again, the other lanes keep going
+    struct Lane
+    {
+        int weight;
+        int reserved;
+        int inFlight;
+        qint64 pass;
+        QQueue<QueuedRequest> queue;
+        QQueue<QueuedRequest> throttled;
+    };
+
+    enum { Lanes = BulkPriority + 1, Stride = 1 << 20, Buckets = 10 };
+
+    struct Circuit
+    {
+        CircuitState state = CircuitClosed;
+
+        // half open, probes let through and how many of them succeeded
+        int probing = 0;
+        int probed = 0;
+
+        // outcomes of the last window, one bucket per tenth of it
+        qint64 bucket[Buckets] = {};
+        int requests[Buckets] = {};
+        int failures[Buckets] = {};
+        int slow[Buckets] = {};
+    };
+
+    struct HeldRequest
+    {
+        QueuedRequest request;
+        RestPriority priority;
+    };
+
+    // a request on the network, for the circuits to learn from
+    struct IssuedRequest
+    {
+        QByteArray host;
+        QByteArray endpoint;
+        qint64 started;
+    };
+
+    static QByteArray route(const QByteArray &resource);
+    bool admit(const QByteArray &endpoint);
+    void probe(const QByteArray &endpoint);
+    void record(const QByteArray &circuit, bool failed, bool slow);
+    void setCircuitState(const QByteArray &circuit, CircuitState state);
+    void releaseHeld();
+    void releaseThrottled();
+
+    void expireDeadlines();
+    void watchDeadline(qint64 deadline, quint64 id);
+    void expireQueued();
+    void timeOut(QNetworkAccessManager::Operation operation, RestHandler handler);
+
+    void schedule();
+
+    void deliver(QNetworkAccessManager::Operation operation, const RestResponse &response, RestHandler handler);
+
+    QByteArray cacheKey(const QNetworkRequest &request);
+    QString cacheFile(const QByteArray &key);
+    bool findCached(const QByteArray &key, CacheEntry &entry);
+    void storeCached(const QByteArray &key, const CacheEntry &entry);
+    void dropCached(const QUrl &url);
+    void countDiskCache();
+    void trimDiskCache();
+    static qint64 freshUntil(QNetworkReply *reply, bool &store);
+
     QHash<QString, QString> makeQueryParams(QString params);
     void setQueryParams(QUrl &url, QHash<QString, QString> params);
 
     void addHeaders(QByteArray headers);
     void setHeaders(QNetworkRequest &request);
 
+    void send(QNetworkAccessManager::Operation operation, const QByteArray &resource, const QByteArray &data,
+              const QHash<QString, QString> &query, RestHandler handler, RestPriority priority = NormalPriority,
+              qint64 deadline = 0);
+
+    // puts the request on the network, returns nullptr if it was answered, held or refused without it
+    QNetworkReply *issue(QNetworkAccessManager::Operation operation, const QByteArray &resource, const QByteArray &data,
+                         const QHash<QString, QString> &query, RestHandler handler, RestPriority priority,
+                         qint64 deadline);
+
+    QNetworkRequest makeRequest(const QByteArray &resource, const QHash<QString, QString> &query);
+    QNetworkRequest buildRequest(const QByteArray &resource, const QHash<QString, QString> &query);
+    void rebuildEndpoints();
+
     MimeTypes mimeTypes;
 
     QHash<QByteArray, QByteArray> headers;
     QByteArray m_host;
+
+    // registered resources with their prebuilt requests, the query is kept
+    // so the prototypes can be rebuilt when host or headers change
+    QHash<QByteArray, QHash<QString, QString>> endpointQueries;
+    QHash<QByteArray, QNetworkRequest> endpoints;
+
+    QHash<QNetworkReply *, RestHandler> handlers;
+
+    bool cacheEnabled = false;
+    QCache<QByteArray, CacheEntry> cache;
+    QString cacheDirectory;
+    QHash<QNetworkReply *, PendingCache> pendingCache;
+
+    qint64 maxDiskBytes = 256 * 1024 * 1024;
+    int maxDiskEntries = 16384;
+    qint64 diskBytes = 0;
+    int diskEntries = 0;
+
+    int maxInFlight = 0;
+    int m_inFlight = 0;
+    qint64 virtualTime = 0;
+    Lane lanes[Lanes] = {
+        {8, 0, 0, 0, {}, {}},
+        {4, 0, 0, 0, {}, {}},
+        {1, 0, 0, 0, {}, {}}
+    };
+
+    // replies holding a slot, with the lane they were issued from
+    QHash<QNetworkReply *, int> replyLanes;
+
+    bool breakerEnabled = false;
+    CircuitBreakerSettings breaker;
+    QHash<QByteArray, Circuit> circuits;
+    QHash<QNetworkReply *, IssuedRequest> issued;
+    QQueue<HeldRequest> held;
+
+    // fires when the earliest lane with throttled requests may try again
+    QTimer throttleTimer;
+
+    // deadlines of replies in flight, the wheel holds ids so an entry outliving its
+    // reply is simply not found. it turns every DeadlineTick ms while it holds any.
+    // requests waiting in a queue are entered as QueuedDeadline, which sweeps the
+    // queues for whatever ran out
+    enum { QueuedDeadline = 0 };
+
+    int defaultTimeout = 0;
+    QHash<QByteArray, int> resourceTimeouts;
+    TimingWheel<quint64> deadlines;
+    QHash<quint64, QNetworkReply *> expiring;
+    QHash<QNetworkReply *, quint64> replyDeadlines;
+    QSet<QNetworkReply *> expired;
+    quint64 lastDeadline = 0;
+    QTimer deadlineTimer;
+
     QNetworkAccessManager networkAccessManager;
 };
 
@@ -0,0 +1,154 @@
+#ifndef RESTCOROUTINE_H
+#define RESTCOROUTINE_H
+
+// C++20 coroutine interface over RestConsumer, include it only from code built as C++20.
+//
+//  Gurra::RestTask flow(SendGrid::SendGridClient &client, SendGrid::SendGridMessage &msg)
+//  {
+//      Gurra::RestResponse batch = co_await Gurra::awaitPost(client, "/mail/batch", {});
+//      ...
+//      Gurra::RestResponse sent = co_await SendGrid::awaitSendEmail(client, msg);
+//  }
+
+#include <coroutine>
+#include <exception>
+
+#include "sendgrid/restconsumer.h"
+#include "sendgrid/sendgridclient.h"
+
+namespace Gurra {
+
+// fire and forget coroutine type, it runs until its first co_await right away
+// and then continues on the thread of the consumer it awaits
+struct RestTask
+{
+    struct promise_type
+    {
+        RestTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// issues its request when awaited and resumes the awaiting coroutine from the
+// request's handler, the handler only captures this so it fits std::function's
+// inline storage, there is no connection per call. a handler called before the
+// request is even issued, e.g. a refusal, doesn't resume the coroutine inside its
+// own await_suspend, await_suspend returns false and it goes on from there
+class RestAwaitable
+{
+public:
+    using Issue = void (*)(RestAwaitable *awaitable, RestHandler handler);
+
+    RestAwaitable(Issue issue, RestConsumer *consumer, QByteArray resource, QByteArray data, QHash<QString, QString> query):
+        consumer {consumer}, resource {resource}, data {data}, query {query}, issue {issue} {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        this->handle = handle;
+        issuing = true;
+
+        issue(this, [this](const RestResponse &response){
+            this->response = response;
+
+            if(issuing) answered = true;
+            else this->handle.resume();
+        });
+
+        issuing = false;
+        return !answered;
+    }
+
+    RestResponse await_resume() { return response; }
+
+    RestConsumer *consumer;
+    QByteArray resource;
+    QByteArray data;
+    QHash<QString, QString> query;
+
+private:
+    Issue issue;
+    RestResponse response;
+
+    std::coroutine_handle<> handle;
+    bool issuing = false;
+    bool answered = false;
+};
+
+inline RestAwaitable awaitGet(RestConsumer &consumer, QByteArray resource, QHash<QString, QString> query = {})
+{
+    return {[](RestAwaitable *a, RestHandler handler){ a->consumer->get(a->resource, handler, a->query); },
+            &consumer, resource, {}, query};
+}
+
+inline RestAwaitable awaitPost(RestConsumer &consumer, QByteArray resource, QByteArray data, QHash<QString, QString> query = {})
+{
+    return {[](RestAwaitable *a, RestHandler handler){ a->consumer->post(a->resource, a->data, handler, a->query); },
+            &consumer, resource, data, query};
+}
+
+inline RestAwaitable awaitPut(RestConsumer &consumer, QByteArray resource, QByteArray data, QHash<QString, QString> query = {})
+{
+    return {[](RestAwaitable *a, RestHandler handler){ a->consumer->put(a->resource, a->data, handler, a->query); },
+            &consumer, resource, data, query};
+}
+
+inline RestAwaitable awaitRemove(RestConsumer &consumer, QByteArray resource, QHash<QString, QString> query = {})
+{
+    return {[](RestAwaitable *a, RestHandler handler){ a->consumer->remove(a->resource, handler, a->query); },
+            &consumer, resource, {}, query};
+}
+
+}
+
+namespace SendGrid {
+
+// the message is serialized when awaited, it only has to live until then. a
+// message rejected on the spot doesn't suspend, like RestAwaitable
+class SendEmailAwaitable
+{
+public:
+    SendEmailAwaitable(SendGridClient &client, SendGridMessage &msg): client {client}, msg {msg} {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        this->handle = handle;
+        issuing = true;
+
+        client.sendEmail(msg, [this](const Gurra::RestResponse &response){
+            this->response = response;
+
+            if(issuing) answered = true;
+            else this->handle.resume();
+        });
+
+        issuing = false;
+        return !answered;
+    }
+
+    Gurra::RestResponse await_resume() { return response; }
+
+private:
+    SendGridClient &client;
+    SendGridMessage &msg;
+    Gurra::RestResponse response;
+
+    std::coroutine_handle<> handle;
+    bool issuing = false;
+    bool answered = false;
+};
+
+inline SendEmailAwaitable awaitSendEmail(SendGridClient &client, SendGridMessage &msg)
+{
+    return {client, msg};
+}
+
+}
+
+#endif // RESTCOROUTINE_H
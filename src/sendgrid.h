@@ -7,25 +7,29 @@
 // </copyright>
 
 #include <QList>
+#include <QHash>
+#include <QSharedPointer>
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QJsonArray>
+#include <QJsonDocument>
 
 namespace SendGrid {
 
 
-template<typename T> QJsonObject hashToJson(QHash<QString, T> &hash){
+// these only read, so a container shared with a copy of its owner stays shared
+template<typename T> QJsonObject hashToJson(const QHash<QString, T> &hash){
 
     QJsonObject obj;
 
-    for(QString key: hash.keys()){
-        obj.insert(key, QJsonValue(hash[key]));
+    for(auto it = hash.constBegin(); it != hash.constEnd(); ++it){
+        obj.insert(it.key(), QJsonValue(it.value()));
     }
 
     return obj;
 }
 
-template<typename T> QJsonArray listToJson(QList<T> &list){
+template<typename T> QJsonArray listToJson(const QList<T> &list){
 
     QJsonArray arr;
 
@@ -36,7 +40,7 @@ template<typename T> QJsonArray listToJson(QList<T> &list){
     return arr;
 }
 
-template<typename T> QJsonArray listToJson2(QList<T> &list){
+template<typename T> QJsonArray listToJson2(const QList<T> &list){
 
     QJsonArray arr;
 
@@ -47,6 +51,94 @@ template<typename T> QJsonArray listToJson2(QList<T> &list){
     return arr;
 }
 
+// number of bytes str takes once encoded as UTF-8, escaping aside
+inline qint64 utf8Size(const QString &str){
+
+    qint64 size = str.size();
+
+    for(QChar c : str){
+        ushort u = c.unicode();
+
+        // surrogates are counted per half, a pair adds up to 4 bytes
+        if(u >= 0x80) size += (u >= 0x800 && !c.isSurrogate()) ? 2 : 1;
+    }
+
+    return size;
+}
+
+// estimated serialized size of a string hash, quotes and separators included
+inline qint64 hashSize(const QHash<QString, QString> &hash){
+
+    qint64 size = 2;
+
+    for(auto it = hash.constBegin(); it != hash.constEnd(); ++it)
+        size += utf8Size(it.key()) + utf8Size(it.value()) + 6;
+
+    return size;
+}
+
+// appends UTF-8 text to out JSON escaped, without quotes
+inline void appendJsonEscaped(QByteArray &out, const char *data, int size){
+
+    static const char hex[] = "0123456789abcdef";
+
+    int run = 0;
+
+    out.reserve(out.size() + size);
+
+    for(int i = 0; i < size; i++){
+
+        uchar c = uchar(data[i]);
+        if(c >= 0x20 && c != '"' && c != '\\') continue;
+
+        // copy the clean run before the character that needs escaping
+        out.append(data + run, i - run);
+        run = i + 1;
+
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        default:
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+    }
+
+    out.append(data + run, size - run);
+}
+
+inline void appendJsonEscaped(QByteArray &out, const QByteArray &utf8){
+
+    appendJsonEscaped(out, utf8.constData(), utf8.size());
+}
+
+// appends str to out JSON escaped and encoded as UTF-8, without quotes
+inline void appendJsonEscaped(QByteArray &out, const QString &str){
+
+    appendJsonEscaped(out, str.toUtf8());
+}
+
+// appends str to out as a quoted JSON string
+inline void appendJsonString(QByteArray &out, const QString &str){
+
+    out += '"';
+    appendJsonEscaped(out, str);
+    out += '"';
+}
+
+inline void appendJsonString(QByteArray &out, const QByteArray &utf8){
+
+    out += '"';
+    appendJsonEscaped(out, utf8);
+    out += '"';
+}
+
 //void removeEmpty(QJsonObject &obj){
 
 //    for(QString key : obj.keys()){
@@ -108,44 +200,64 @@ struct ASM
 
 /// <summary>
 /// Gets or sets an array of objects in which you can specify any attachments you want to include.
+/// Fields are kept as UTF-8, so they go to the wire without being converted.
 /// </summary>
 struct Attachment
 {
     /// <summary>
     /// Gets or sets the Base64 encoded content of the attachment.
     /// </summary>
-    QString content;
+    QByteArray content;
 
     /// <summary>
     /// Gets or sets the mime type of the content you are attaching. For example, application/pdf or image/jpeg.
     /// </summary>
-    QString type;
+    QByteArray type;
 
     /// <summary>
     /// Gets or sets the filename of the attachment.
     /// </summary>
-    QString filename;
+    QByteArray filename;
 
     /// <summary>
     /// Gets or sets the content-disposition of the attachment specifying how you would like the attachment to be displayed. For example, "inline" results in the attached file being displayed automatically within the message while "attachment" results in the attached file requiring some action to be taken before it is displayed (e.g. opening or downloading the file). Defaults to "attachment". Can be either "attachment" or "inline".
     /// </summary>
-    QString disposition;
+    QByteArray disposition;
 
     /// <summary>
     /// Gets or sets a unique id that you specify for the attachment. This is used when the disposition is set to "inline" and the attachment is an image, allowing the file to be displayed within the body of your email. Ex: <img src="cid:ii_139db99fdb5c3704"></img>
     /// </summary>
-    QString contentId;
+    QByteArray contentId;
 
     QJsonObject toJson(){
         return {
-            {"content", QJsonValue(content)},
-            {"type", QJsonValue(type)},
-            {"filename", QJsonValue(filename)},
-            {"disposition", QJsonValue(disposition)},
-            {"contentId", QJsonValue(contentId)}
+            {"content", QJsonValue(QString::fromUtf8(content))},
+            {"type", QJsonValue(QString::fromUtf8(type))},
+            {"filename", QJsonValue(QString::fromUtf8(filename))},
+            {"disposition", QJsonValue(QString::fromUtf8(disposition))},
+            {"contentId", QJsonValue(QString::fromUtf8(contentId))}
         };
     }
 
+    // the same object as toJson() written straight to out, keys in the same order
+    void writeJson(QByteArray &out) const {
+        out += "{\"content\":";
+        appendJsonString(out, content);
+        out += ",\"contentId\":";
+        appendJsonString(out, contentId);
+        out += ",\"disposition\":";
+        appendJsonString(out, disposition);
+        out += ",\"filename\":";
+        appendJsonString(out, filename);
+        out += ",\"type\":";
+        appendJsonString(out, type);
+        out += '}';
+    }
+
+    qint64 jsonSize() const {
+        return content.size() + type.size() + filename.size() + disposition.size() + contentId.size() + 72;
+    }
+
 };
 
 
@@ -229,26 +341,50 @@ struct Content
     /// <param name="value">The actual content of the specified mime type that you are including in your email.</param>
     Content(QString type, QString value)
     {
-        this->type = type;
-        this->value = value;
+        this->type = type.toUtf8();
+        this->value = value.toUtf8();
+    }
+
+    /// <summary>
+    /// Creates a <see cref="Content"/> from UTF-8 text, which is kept as it is. A named factory rather than a constructor, so two string literals still pick the QString one.
+    /// </summary>
+    static Content fromUtf8(QByteArray type, QByteArray value)
+    {
+        Content content;
+        content.type = type;
+        content.value = value;
+
+        return content;
     }
 
     /// <summary>
     /// Gets or sets the mime type of the content you are including in your email. For example, text/plain or text/html.
     /// </summary>
-    QString type;
+    QByteArray type;
 
     /// <summary>
-    /// Gets or sets the actual content of the specified mime type that you are including in your email.
+    /// Gets or sets the actual content of the specified mime type that you are including in your email, as UTF-8.
     /// </summary>
-    QString value;
+    QByteArray value;
 
     QJsonObject toJson(){
         return {
-            {"type", QJsonValue(type)},
-            {"value", QJsonValue(value)}
+            {"type", QJsonValue(QString::fromUtf8(type))},
+            {"value", QJsonValue(QString::fromUtf8(value))}
         };
     }
+
+    void writeJson(QByteArray &out) const {
+        out += "{\"type\":";
+        appendJsonString(out, type);
+        out += ",\"value\":";
+        appendJsonString(out, value);
+        out += '}';
+    }
+
+    qint64 jsonSize() const {
+        return type.size() + value.size() + 24;
+    }
 };
 
 /// <summary>
@@ -291,6 +427,10 @@ struct EmailAddress
         };
     }
 
+    qint64 jsonSize() const {
+        return utf8Size(name) + utf8Size(email) + 24;
+    }
+
 };
 
 /// <summary>
@@ -380,8 +520,8 @@ struct HtmlContent : public Content
     /// <param name="value">The actual content of the specified mime type that you are including in your email.</param>
     HtmlContent(QString value)
     {
-        this->type = SendGridMimeType::Html;
-        this->value = value;
+        this->type = SendGridMimeType::Html.toUtf8();
+        this->value = value.toUtf8();
     }
 };
 
@@ -441,28 +581,35 @@ struct MailSettings
     /// <summary>
     /// Gets or sets the address specified in the mail_settings.bcc object will receive a blind carbon copy (BCC) of the very first personalization defined in the personalizations array.
     /// </summary>
-    BCCSettings *bccSettings = nullptr;
+    QSharedPointer<BCCSettings> bccSettings;
 
     /// <summary>
     /// Gets or sets the bypass of all unsubscribe groups and suppressions to ensure that the email is delivered to every single recipient. This should only be used in emergencies when it is absolutely necessary that every recipient receives your email. Ex: outage emails, or forgot password emails.
     /// </summary>
-    BypassListManagement *bypassListManagement = nullptr;
+    QSharedPointer<BypassListManagement> bypassListManagement;
 
     /// <summary>
     /// Gets or sets the default footer that you would like appended to the bottom of every email.
     /// </summary>
-    FooterSettings *footerSettings = nullptr;
+    QSharedPointer<FooterSettings> footerSettings;
 
     /// <summary>
     /// Gets or sets the ability to send a test email to ensure that your request body is valid and formatted correctly. For more information, please see our Classroom.
     /// https://sendgrid.com/docs/Classroom/Send/v3_Mail_Send/sandbox_mode.html
     /// </summary>
-    SandboxMode *sandboxMode = nullptr;
+    QSharedPointer<SandboxMode> sandboxMode;
 
     /// <summary>
     /// Gets or sets the ability to test the content of your email for spam.
     /// </summary>
-    SpamCheck *spamCheck = nullptr;
+    QSharedPointer<SpamCheck> spamCheck;
+
+    // each setting is replaced whole and never changed in place, so copies of
+    // the settings share them
+    bool isEmpty() const
+    {
+        return !bccSettings && !bypassListManagement && !footerSettings && !sandboxMode && !spamCheck;
+    }
 
     QJsonObject toJson(){
 
@@ -543,12 +690,17 @@ struct Personalization
     /// </summary>
     QHash<QString, QString> customArgs;
 
+    /// <summary>
+    /// Gets or sets the data a dynamic template is rendered with, any JSON the template's handlebars refer to. Dynamic templates don't use substitutions.
+    /// </summary>
+    QJsonObject dynamicTemplateData;
+
     /// <summary>
     /// Gets or sets a unix timestamp allowing you to specify when you want your email to be sent from SendGrid. This is not necessary if you want the email to be sent at the time of your API request.
     /// </summary>
     qint64 sendAt = 0;
 
-    QJsonObject toJson(){
+    QJsonObject toJson() const {
 
         QJsonObject obj;
 
@@ -558,10 +710,29 @@ struct Personalization
         if(!subject.isEmpty()) obj.insert("subject", QJsonValue(subject));
         if(!substitutions.isEmpty()) obj.insert("substitutions", QJsonValue(hashToJson(substitutions)));
         if(!customArgs.isEmpty()) obj.insert("custom_args", QJsonValue(hashToJson(customArgs)));
+        if(!dynamicTemplateData.isEmpty()) obj.insert("dynamic_template_data", QJsonValue(dynamicTemplateData));
         if(sendAt > 0) obj.insert("send_at", QJsonValue(sendAt));
 
         return obj;
     }
+
+    qint64 jsonSize() const {
+
+        qint64 size = 2;
+
+        for(const EmailAddress &email : to) size += email.jsonSize();
+        for(const EmailAddress &email : cc) size += email.jsonSize();
+        for(const EmailAddress &email : bcc) size += email.jsonSize();
+
+        if(!subject.isEmpty()) size += utf8Size(subject) + 14;
+        if(!headers.isEmpty()) size += hashSize(headers) + 12;
+        if(!substitutions.isEmpty()) size += hashSize(substitutions) + 18;
+        if(!customArgs.isEmpty()) size += hashSize(customArgs) + 16;
+        if(!dynamicTemplateData.isEmpty()) size += QJsonDocument(dynamicTemplateData).toJson(QJsonDocument::Compact).size() + 26;
+        if(sendAt > 0) size += 32;
+
+        return size + 24;
+    }
 };
 
 /// <summary>
@@ -575,8 +746,8 @@ struct PlainTextContent : public Content
     /// <param name="value">The actual content of the specified mime type that you are including in your email.</param>
     PlainTextContent(QString value)
     {
-        this->type = SendGridMimeType::Text;
-        this->value = value;
+        this->type = SendGridMimeType::Text.toUtf8();
+        this->value = value.toUtf8();
     }
 };
 
@@ -623,22 +794,28 @@ struct TrackingSettings
     /// <summary>
     /// Gets or sets tracking whether a recipient clicked a link in your email.
     /// </summary>
-    ClickTracking *clickTracking = nullptr;
+    QSharedPointer<ClickTracking> clickTracking;
 
     /// <summary>
     /// Gets or sets tracking whether the email was opened or not, but including a single pixel image in the body of the content. When the pixel is loaded, we can log that the email was opened.
     /// </summary>
-    OpenTracking *openTracking = nullptr;
+    QSharedPointer<OpenTracking> openTracking;
 
     /// <summary>
     /// Gets or sets a subscription management link at the bottom of the text and html bodies of your email. If you would like to specify the location of the link within your email, you may use the substitution_tag.
     /// </summary>
-    SubscriptionTracking *subscriptionTracking = nullptr;
+    QSharedPointer<SubscriptionTracking> subscriptionTracking;
 
     /// <summary>
     /// Gets or sets tracking provided by Google Analytics.
     /// </summary>
-    Ganalytics *ganalytics = nullptr;
+    QSharedPointer<Ganalytics> ganalytics;
+
+    // shared between copies like MailSettings
+    bool isEmpty() const
+    {
+        return !clickTracking && !openTracking && !subscriptionTracking && !ganalytics;
+    }
 
     QJsonObject toJson(){
 
@@ -1,17 +1,24 @@
 #include "sendgridclient.h"
 
+#include <QDateTime>
+#include <QTimer>
+
 using namespace SendGrid;
 
 const QString SendGridMimeType::Html = "text/html";
 const QString SendGridMimeType::Text = "text/plain";
 
+const QString SendGridClient::IdempotencyKey = "idempotency_key";
+
 SendGridClient::SendGridClient()
 {
-
+    connectLogging();
 }
 
 SendGridClient::SendGridClient(QByteArray apiKey, QByteArray host, QHash<QByteArray, QByteArray> requestHeaders, QString urlPath)
 {
+    connectLogging();
+
     setHost(host);
     this->urlPath = urlPath;
 
@@ -24,10 +31,13 @@ SendGridClient::SendGridClient(QByteArray apiKey, QByteArray host, QHash<QByteAr
 
     addHeaders(defaultHeaders);
     addHeaders(requestHeaders);
+
+    registerEndpoint("/mail/send");
 }
 
-void SendGridClient::sendEmail(SendGridMessage &msg)
+void SendGridClient::connectLogging()
 {
+    // connected once here, not per sendEmail call
     connect(this, &RestConsumer::serverError, [](const QByteArray err){
         qDebug() << err;
     });
@@ -39,7 +49,459 @@ void SendGridClient::sendEmail(SendGridMessage &msg)
     connect(this, &RestConsumer::networkError, [](){
         qDebug() << "RestConsumer::networkError";
     });
+}
+
+SendGridClient::~SendGridClient()
+{
+    delete sent;
+}
+
+void SendGridClient::setDeduplicationWindow(qint64 seconds, int capacity)
+{
+    delete sent;
+    sent = seconds > 0 ? new FingerprintIndex(capacity, seconds) : nullptr;
+}
+
+void SendGridClient::addApiKey(QByteArray apiKey, double rate, double weight, QByteArray onBehalfOf)
+{
+    apiKeys.addKey(apiKey, rate, weight, onBehalfOf);
+}
+
+void SendGridClient::setSuppressionCache(SuppressionCache *cache)
+{
+    suppressions = cache;
+}
+
+SuppressionCache *SendGridClient::suppressionCache(){
+    return suppressions;
+}
+
+void SendGridClient::setTemplateRegistry(TemplateRegistry *registry)
+{
+    templates = registry;
+}
+
+TemplateRegistry *SendGridClient::templateRegistry(){
+    return templates;
+}
+
+void SendGridClient::setMemoryBudget(qint64 bytes){
+    memoryBudget = qMax<qint64>(0, bytes);
+}
+
+qint64 SendGridClient::memoryUsage(){
+    return m_memoryUsage;
+}
+
+qint64 SendGridClient::memoryHighWater(){
+    return m_memoryHighWater;
+}
+
+void SendGridClient::resetMemoryHighWater(){
+    m_memoryHighWater = m_memoryUsage;
+}
+
+bool SendGridClient::chargeMemory(qint64 bytes)
+{
+    if(!admit(bytes)) return false;
+
+    m_memoryUsage += bytes;
+    m_memoryHighWater = qMax(m_memoryHighWater, m_memoryUsage);
+
+    return true;
+}
+
+void SendGridClient::releaseMemory(qint64 bytes){
+    m_memoryUsage -= bytes;
+}
+
+bool SendGridClient::admit(qint64 bytes)
+{
+    return memoryBudget <= 0 || m_memoryUsage == 0 || m_memoryUsage + bytes <= memoryBudget;
+}
+
+void SendGridClient::setCoalescingWindow(int milliseconds)
+{
+    coalescingWindow = qMax(0, milliseconds);
+}
+
+void SendGridClient::prepareRequest(QNetworkRequest &request)
+{
+    // the token is only taken in throttle(), once the request will really be sent
+    if(!apiKeys.isEmpty()) apiKeys.apply(apiKeys.pick(), request);
+}
+
+int SendGridClient::throttle(QNetworkRequest &request)
+{
+    QVariant key = request.attribute(ApiKeyPool::KeyAttribute);
+
+    return key.isValid() ? apiKeys.acquire(key.toInt()) : 0;
+}
+
+void SendGridClient::inspectReply(QNetworkReply *reply)
+{
+    QVariant key = reply->request().attribute(ApiKeyPool::KeyAttribute);
+    if(!key.isValid()) return;
+
+    QByteArray remaining = reply->rawHeader("X-RateLimit-Remaining");
+    int statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    apiKeys.update(key.toInt(), statusCode, remaining.isEmpty() ? -1 : remaining.toInt());
+}
+
+void SendGridClient::sendEmail(SendGridMessage &msg)
+{
+    sendEmail(msg, nullptr);
+}
 
-    post("/mail/send", msg.toString());
+void SendGridClient::sendEmail(SendGridMessage &msg, Gurra::RestHandler handler, Gurra::RestPriority priority)
+{
+    // refused before serializing, which would take the memory the budget protects
+    if(!admit(msg.estimatedSize())) {
+        reject(handler, "memory budget exceeded");
+        return;
+    }
+
+    PreparedMessage prepared = prepare(msg);
+    prepared.priority = priority;
+
+    sendPrepared(prepared, handler);
+}
+
+PreparedMessage SendGridClient::prepare(SendGridMessage &msg)
+{
+    return prepare(msg, sent, suppressions, templates);
+}
+
+PreparedMessage SendGridClient::prepare(SendGridMessage &msg, bool fingerprint, SuppressionCache *suppressions,
+                                        TemplateRegistry *templates)
+{
+    PreparedMessage prepared;
+
+    if(suppressions && suppressions->count())
+    {
+        int removed = msg.removeRecipients([suppressions](const EmailAddress &address){
+            return suppressions->contains(address.email);
+        });
+
+        if(removed && !msg.personalizationCount()) {
+            prepared.rejection = "every recipient is suppressed";
+            return prepared;
+        }
+    }
+
+    if(templates) prepared.rejection = templates->check(msg);
+    if(!prepared.rejection.isEmpty()) return prepared;
+
+    // fail locally instead of uploading a message the server rejects,
+    // too many personalizations or too large a payload is fixed by splitting
+    prepared.validation = msg.validate();
+    prepared.split = prepared.validation == TooManyPersonalizations || prepared.validation == MessageTooLarge;
+
+    if(prepared.validation != NoMessageError && !prepared.split) return prepared;
+
+    prepared.obj = msg.toJson(&prepared.bodies);
+
+    if(fingerprint)
+    {
+        prepared.fingerprinted = true;
+        prepared.fingerprint = SendGridMessage::fingerprint(prepared.obj, IdempotencyKey, prepared.bodies);
+
+        QJsonObject args = prepared.obj.value("custom_args").toObject();
+        args.insert(IdempotencyKey, QString::number(prepared.fingerprint, 16));
+        prepared.obj.insert("custom_args", args);
+    }
+
+    prepared.size = msg.estimatedSize();
+
+    // charged for the payloads that can exist at once, not for all of them
+    if(msg.hasLocalSubstitutions())
+    {
+        prepared.local = true;
+        prepared.renderer = QSharedPointer<const PayloadRenderer>::create(msg.payloadRenderer(prepared.obj));
+        prepared.size = prepared.renderer->maxPayloadSize() * qMin(prepared.renderer->count(), RenderWindow);
+    }
+
+    return prepared;
+}
+
+void SendGridClient::sendPrepared(const PreparedMessage &prepared, Gurra::RestHandler handler)
+{
+    if(!prepared.rejection.isEmpty()) {
+        reject(handler, prepared.rejection);
+        return;
+    }
+
+    if(prepared.validation != NoMessageError && !prepared.split) {
+        reject(handler, SendGridMessage::errorString(prepared.validation));
+        return;
+    }
+
+    bool deduplicate = sent && prepared.fingerprinted;
+    quint64 fingerprint = prepared.fingerprint;
+
+    if(deduplicate && sent->contains(fingerprint, QDateTime::currentSecsSinceEpoch())) {
+        reject(handler, "duplicate message suppressed");
+        return;
+    }
+
+    if(!admit(prepared.size)) {
+        reject(handler, "memory budget exceeded");
+        return;
+    }
+
+    qint64 size = prepared.size;
+
+    // recorded as it goes out, an identical message sent before this one is
+    // answered, or after an answer that never arrived, is suppressed
+    if(deduplicate) sent->insert(fingerprint, QDateTime::currentSecsSinceEpoch());
+
+    m_memoryUsage += size;
+    m_memoryHighWater = qMax(m_memoryHighWater, m_memoryUsage);
+
+    // one completion for the message, however many requests it took
+    Gurra::RestHandler done = [this, deduplicate, fingerprint, handler, size](const Gurra::RestResponse &response){
+
+        m_memoryUsage -= size;
+
+        if(deduplicate && sent && (!response.error.isEmpty() || response.statusCode >= 400))
+            sent->remove(fingerprint);
+
+        if(handler) handler(response);
+        else emitResponse(QNetworkAccessManager::PostOperation, response);
+    };
+
+    if(prepared.local) dispatch(prepared.renderer, done, prepared.priority);
+    else if(prepared.split) sendSplit(prepared.obj, prepared.bodies, done, prepared.priority);
+    else if(coalescingWindow > 0) coalesce(prepared.obj, prepared.bodies, done, prepared.priority);
+    else post("/mail/send", SendGridMessage::withBodies(QJsonDocument(prepared.obj).toJson(QJsonDocument::Compact), prepared.bodies),
+              done, {}, prepared.priority);
+}
+
+void SendGridClient::coalesce(QJsonObject obj, const QByteArray &bodies, Gurra::RestHandler done, Gurra::RestPriority priority)
+{
+    QJsonArray personalizations = obj.take("personalizations").toArray();
+
+    // the idempotency key differs per message, it moves into the personalizations
+    // so messages that are otherwise the same can share a request
+    QJsonObject args = obj.value("custom_args").toObject();
+    QJsonValue idempotencyKey = args.take(IdempotencyKey);
+
+    if(!idempotencyKey.isUndefined())
+    {
+        if(args.isEmpty()) obj.remove("custom_args");
+        else obj.insert("custom_args", args);
+
+        for(int i = 0; i < personalizations.size(); i++)
+        {
+            QJsonObject personalization = personalizations.at(i).toObject();
+            QJsonObject personalArgs = personalization.value("custom_args").toObject();
+
+            personalArgs.insert(IdempotencyKey, idempotencyKey);
+            personalization.insert("custom_args", personalArgs);
+            personalizations.replace(i, personalization);
+        }
+    }
+
+    QByteArray body = SendGridMessage::withBodies(QJsonDocument(obj).toJson(QJsonDocument::Compact), bodies);
+    QByteArray key = QCryptographicHash::hash(body, QCryptographicHash::Sha1) + char('0' + priority);
+
+    QByteArrayList items;
+    qint64 size = 0;
+
+    for(const QJsonValue &personalization : personalizations)
+    {
+        items.append(QJsonDocument(personalization.toObject()).toJson(QJsonDocument::Compact));
+        size += items.last().size() + 1;
+    }
+
+    auto it = coalescing.find(key);
+
+    // full, it goes now and this message starts the next one
+    if(it != coalescing.end() && (it->personalizations + items.size() > SendGridMessage::MaxPersonalizations
+                                  || it->size + size > SendGridMessage::MaxPayloadSize)) {
+        flushCoalesced(key);
+        it = coalescing.end();
+    }
+
+    if(it == coalescing.end())
+    {
+        QByteArray tail = "]}";
+        if(body.size() > 2) tail = "]," + body.mid(1);
+
+        quint64 id = ++lastCoalesced;
+        it = coalescing.insert(key, Coalesced {id, priority, tail, {}, {}, 0, 24 + tail.size()});
+
+        QTimer::singleShot(coalescingWindow, this, [this, key, id]{
+            auto open = coalescing.constFind(key);
+            if(open != coalescing.constEnd() && open->id == id) flushCoalesced(key);
+        });
+    }
+
+    it->members.append(items);
+    it->dones.append(done);
+    it->personalizations += items.size();
+    it->size += size;
+}
+
+void SendGridClient::flushCoalesced(QByteArray key)
+{
+    Coalesced batch = coalescing.take(key);
+    QByteArray head = "{\"personalizations\":[";
+
+    if(batch.members.size() == 1) {
+        post("/mail/send", head + batch.members.first().join(',') + batch.tail, batch.dones.first(), {}, batch.priority);
+        return;
+    }
+
+    QByteArray payload = head;
+    payload.reserve(int(batch.size));
+
+    for(int i = 0; i < batch.members.size(); i++)
+    {
+        if(i) payload += ',';
+        payload += batch.members.at(i).join(',');
+    }
+
+    payload += batch.tail;
+
+    post("/mail/send", payload, [this, batch, head](const Gurra::RestResponse &response){
+
+        // SendGrid refuses the whole request for one bad message, so a refused
+        // batch is sent again one message at a time to find out which
+        if(response.statusCode == 400)
+        {
+            for(int i = 0; i < batch.members.size(); i++)
+                post("/mail/send", head + batch.members.at(i).join(',') + batch.tail, batch.dones.at(i), {}, batch.priority);
+
+            return;
+        }
+
+        for(const Gurra::RestHandler &done : batch.dones) done(response);
+
+    }, {}, batch.priority);
+}
+
+void SendGridClient::sendSplit(QJsonObject obj, const QByteArray &bodies, Gurra::RestHandler done, Gurra::RestPriority priority)
+{
+    QJsonArray personalizations = obj.take("personalizations").toArray();
+
+    // everything but the personalizations is serialized once and shared by all chunks
+    QByteArray body = SendGridMessage::withBodies(QJsonDocument(obj).toJson(QJsonDocument::Compact), bodies);
+    QByteArray head = "{\"personalizations\":[";
+    QByteArray tail = "]}";
+
+    if(body.size() > 2) tail = "]," + body.mid(1);
+
+    qint64 room = SendGridMessage::MaxPayloadSize - head.size() - tail.size();
+
+    // the shared part alone is over the limit, splitting cannot help
+    if(personalizations.isEmpty() || room <= 0) {
+        reject(done, SendGridMessage::errorString(MessageTooLarge));
+        return;
+    }
+
+    QByteArrayList chunks;
+    QByteArray chunk;
+    int count = 0;
+
+    for(const QJsonValue &personalization : personalizations)
+    {
+        QByteArray item = QJsonDocument(personalization.toObject()).toJson(QJsonDocument::Compact);
+
+        if(item.size() >= room) {
+            reject(done, SendGridMessage::errorString(MessageTooLarge));
+            return;
+        }
+
+        if(count == SendGridMessage::MaxPersonalizations || chunk.size() + item.size() + 1 > room) {
+            chunks.append(head + chunk + tail);
+            chunk.clear();
+            count = 0;
+        }
+
+        if(count) chunk += ',';
+        chunk += item;
+        count++;
+    }
+
+    if(count) chunks.append(head + chunk + tail);
+
+    dispatch(chunks, done, priority);
+}
+
+void SendGridClient::dispatch(const QByteArrayList &payloads, Gurra::RestHandler done, Gurra::RestPriority priority)
+{
+    if(payloads.isEmpty()) {
+        reject(done, "message has no personalizations");
+        return;
+    }
+
+    struct DispatchState
+    {
+        int remaining;
+        bool failed;
+        Gurra::RestResponse failure;
+    };
+
+    QSharedPointer<DispatchState> state(new DispatchState {payloads.size(), false, {}});
+
+    // payloads go out together, the first failure is what the message reports
+    for(const QByteArray &payload : payloads)
+    {
+        post("/mail/send", payload, [state, done](const Gurra::RestResponse &response){
+
+            if(!response.isSuccess() && !state->failed) {
+                state->failed = true;
+                state->failure = response;
+            }
+
+            if(--state->remaining == 0) done(state->failed ? state->failure : response);
+
+        }, {}, priority);
+    }
+}
+
+void SendGridClient::dispatch(QSharedPointer<const PayloadRenderer> renderer, Gurra::RestHandler done, Gurra::RestPriority priority)
+{
+    if(!renderer->count()) {
+        reject(done, "message has no personalizations");
+        return;
+    }
+
+    QSharedPointer<RenderState> state(new RenderState {renderer, done, priority, 0, renderer->count(), false, {}});
+
+    for(int i = 0; i < RenderWindow; i++) dispatchNext(state);
+}
+
+void SendGridClient::dispatchNext(QSharedPointer<RenderState> state)
+{
+    if(state->next == state->renderer->count()) return;
+
+    // rendered just before it is posted, each answer lets the next one go,
+    // the first failure is what the message reports
+    post("/mail/send", state->renderer->render(state->next++), [this, state](const Gurra::RestResponse &response){
+
+        if(!response.isSuccess() && !state->failed) {
+            state->failed = true;
+            state->failure = response;
+        }
+
+        if(--state->remaining == 0) {
+            state->done(state->failed ? state->failure : response);
+            return;
+        }
+
+        dispatchNext(state);
+
+    }, {}, state->priority);
+}
+
+void SendGridClient::reject(Gurra::RestHandler handler, QByteArray reason)
+{
+    Gurra::RestResponse response;
+    response.error = reason;
 
+    if(handler) handler(response);
+    else emit error(reason);
 }
@@ -3,11 +3,47 @@
 
 #include "sendgrid/restconsumer.h"
 #include "sendgrid/sendgridmessage.h"
+#include "sendgrid/fingerprintindex.h"
+#include "sendgrid/apikeypool.h"
+#include "sendgrid/suppressioncache.h"
+#include "sendgrid/templateregistry.h"
 
 #include <QString>
+#include <QSharedPointer>
 
 namespace SendGrid {
 
+// a message checked and serialized, it no longer refers to the message or a client
+// so it can be built on one thread and sent from another
+struct PreparedMessage
+{
+    SendGridMessageError validation = NoMessageError;
+    bool split = false;
+
+    // why it is refused besides the limits, every recipient suppressed or a
+    // template problem. empty if it can go
+    QByteArray rejection;
+
+    bool fingerprinted = false;
+    quint64 fingerprint = 0;
+
+    // everything but content and attachments, which are serialized already in
+    // bodies, see SendGridMessage::toJson(QByteArray *)
+    QJsonObject obj;
+    QByteArray bodies;
+
+    // renders one payload per personalization when substitutions are applied
+    // locally, the payloads are built as they are posted
+    bool local = false;
+    QSharedPointer<const PayloadRenderer> renderer;
+
+    // the lane its requests wait in, see RestConsumer::setMaxInFlight
+    Gurra::RestPriority priority = Gurra::NormalPriority;
+
+    // bytes of payload it will hold until its requests are answered
+    qint64 size = 0;
+};
+
 class SendGridClient : public Gurra::RestConsumer
 {
 
@@ -15,9 +51,129 @@ public:
     SendGridClient();
     SendGridClient(QByteArray apiKey, QByteArray host = "https://api.sendgrid.com/v3", QHash<QByteArray, QByteArray> requestHeaders = {}, QString urlPath = {});
 
+    ~SendGridClient();
+
     void sendEmail(SendGridMessage &msg);
 
+    // handler receives the outcome instead of the signals, a message over the
+    // personalization or size limits is split and reports once all parts are done
+    void sendEmail(SendGridMessage &msg, Gurra::RestHandler handler, Gurra::RestPriority priority = Gurra::NormalPriority);
+
+    // the two halves of sendEmail, prepare touches no client state so it may
+    // run on any thread, fingerprint is whether deduplication is in use.
+    // suppressed recipients are dropped and the template checked here, both
+    // lookups are safe from any thread
+    static PreparedMessage prepare(SendGridMessage &msg, bool fingerprint, SuppressionCache *suppressions = nullptr,
+                                   TemplateRegistry *templates = nullptr);
+    void sendPrepared(const PreparedMessage &prepared, Gurra::RestHandler handler);
+
+    // prepare with this client's deduplication, suppression cache and template
+    // registry, as sendEmail does
+    PreparedMessage prepare(SendGridMessage &msg);
+
+    // suppresses messages whose fingerprint was sent within window seconds, also
+    // while the first one is still waiting for its answer. a fingerprint is taken
+    // back when its send definitely failed, refused locally or answered with an
+    // error status. a lost answer keeps it since the server may have accepted the
+    // message. the fingerprint goes along in custom_args only to match webhook
+    // events, SendGrid doesn't deduplicate on it. 0 disables it
+    void setDeduplicationWindow(qint64 seconds, int capacity = 1 << 20);
+
+    // custom_args key carrying the message fingerprint
+    static const QString IdempotencyKey;
+
+    // spreads requests over several keys or subusers instead of the one given
+    // to the constructor, see ApiKeyPool
+    void addApiKey(QByteArray apiKey, double rate, double weight = 1, QByteArray onBehalfOf = {});
+
+    // suppressed addresses are dropped from messages when they are prepared,
+    // the cache is not owned. nullptr stops filtering
+    void setSuppressionCache(SuppressionCache *cache);
+    SuppressionCache *suppressionCache();
+
+    // messages using a template the registry doesn't know, or lacking keys a
+    // dynamic template needs, are rejected locally. the registry is not owned
+    void setTemplateRegistry(TemplateRegistry *registry);
+    TemplateRegistry *templateRegistry();
+
+    // messages sent within milliseconds of each other that differ only in their
+    // personalizations go out as one request, and every caller gets its response.
+    // 0, the default, sends each message on its own
+    void setCoalescingWindow(int milliseconds);
+
+    // bounds the bytes of payload held by messages waiting to be sent or answered,
+    // a message that doesn't fit is rejected until earlier ones complete. one
+    // message is always let through when nothing is held. 0, the default, is no bound
+    void setMemoryBudget(qint64 bytes);
+    qint64 memoryUsage();
+    qint64 memoryHighWater();
+    void resetMemoryHighWater();
+
+    // charges payload held on the client's behalf, e.g. by a scheduler until its
+    // send time, against the budget. false, with nothing charged, if it doesn't fit
+    bool chargeMemory(qint64 bytes);
+    void releaseMemory(qint64 bytes);
+
+protected:
+    void prepareRequest(QNetworkRequest &request) override;
+    void inspectReply(QNetworkReply *reply) override;
+    int throttle(QNetworkRequest &request) override;
+
 private:
+    void connectLogging();
+
+    ApiKeyPool apiKeys;
+
+    void sendSplit(QJsonObject obj, const QByteArray &bodies, Gurra::RestHandler done, Gurra::RestPriority priority);
+    void dispatch(const QByteArrayList &payloads, Gurra::RestHandler done, Gurra::RestPriority priority);
+
+    // locally rendered payloads of a message, at most RenderWindow of them are
+    // built and in flight at a time and the message is charged for that many
+    static const int RenderWindow = 8;
+
+    struct RenderState
+    {
+        QSharedPointer<const PayloadRenderer> renderer;
+        Gurra::RestHandler done;
+        Gurra::RestPriority priority;
+        int next;
+        int remaining;
+        bool failed;
+        Gurra::RestResponse failure;
+    };
+
+    void dispatch(QSharedPointer<const PayloadRenderer> renderer, Gurra::RestHandler done, Gurra::RestPriority priority);
+    void dispatchNext(QSharedPointer<RenderState> state);
+    void reject(Gurra::RestHandler handler, QByteArray reason);
+    bool admit(qint64 bytes);
+
+    // messages waiting for their coalescing window, by their shared part
+    struct Coalesced
+    {
+        quint64 id;
+        Gurra::RestPriority priority;
+        QByteArray tail;
+        QList<QByteArrayList> members;
+        QList<Gurra::RestHandler> dones;
+        int personalizations;
+        qint64 size;
+    };
+
+    void coalesce(QJsonObject obj, const QByteArray &bodies, Gurra::RestHandler done, Gurra::RestPriority priority);
+    void flushCoalesced(QByteArray key);
+
+    QHash<QByteArray, Coalesced> coalescing;
+    int coalescingWindow = 0;
+    quint64 lastCoalesced = 0;
+
+    qint64 memoryBudget = 0;
+    qint64 m_memoryUsage = 0;
+    qint64 m_memoryHighWater = 0;
+
+    FingerprintIndex *sent = nullptr;
+    SuppressionCache *suppressions = nullptr;
+    TemplateRegistry *templates = nullptr;
+
     QByteArray version = "1.0";
     QString urlPath;
     QString mediaType;
@@ -0,0 +1,678 @@
+#include "sendgridmessage.h"
+
+#include <QCborStreamWriter>
+#include <QCborStreamReader>
+#include <QCborValue>
+
+using namespace SendGrid;
+
+// keys of the binary snapshot, new fields get new keys and readers skip
+// the keys they don't know, so the format only needs a new version when
+// the meaning of an existing key changes
+static const qint64 BinaryVersion = 1;
+
+enum BinaryKey
+{
+    FromKey,
+    SubjectKey,
+    PersonalizationsKey,
+    ContentsKey,
+    AttachmentsKey,
+    TemplateIdKey,
+    HeadersKey,
+    SectionsKey,
+    CategoriesKey,
+    CustomArgsKey,
+    SendAtKey,
+    AsmKey,
+    BatchIdKey,
+    IpPoolNameKey,
+    MailSettingsKey,
+    TrackingSettingsKey,
+    ReplyToKey,
+    LocalSubstitutionsKey,
+    NormalizeKey
+};
+
+enum PersonalizationKey
+{
+    ToKey,
+    CcKey,
+    BccKey,
+    PersonalizationSubjectKey,
+    PersonalizationHeadersKey,
+    SubstitutionsKey,
+    PersonalizationCustomArgsKey,
+    PersonalizationSendAtKey,
+    DynamicTemplateDataKey
+};
+
+enum SettingKey
+{
+    BccSettingsKey,
+    BypassListManagementKey,
+    FooterSettingsKey,
+    SandboxModeKey,
+    SpamCheckKey,
+    ClickTrackingKey,
+    OpenTrackingKey,
+    SubscriptionTrackingKey,
+    GanalyticsKey
+};
+
+// null strings are kept apart from empty ones
+static void writeString(QCborStreamWriter &writer, const QString &str)
+{
+    if(str.isNull()) writer.append(nullptr);
+    else writer.append(QStringView(str));
+}
+
+// text already held as UTF-8 is written as it is
+static void writeUtf8(QCborStreamWriter &writer, const QByteArray &utf8)
+{
+    if(utf8.isNull()) writer.append(nullptr);
+    else writer.appendTextString(utf8.constData(), utf8.size());
+}
+
+static void writeUtf8Strings(QCborStreamWriter &writer, std::initializer_list<QByteArray> strings)
+{
+    for(const QByteArray &utf8 : strings) writeUtf8(writer, utf8);
+}
+
+static void writeKey(QCborStreamWriter &writer, int key)
+{
+    writer.append(qint64(key));
+}
+
+static void writeAddress(QCborStreamWriter &writer, const EmailAddress &address)
+{
+    writer.startArray(2);
+    writeString(writer, address.email);
+    writeString(writer, address.name);
+    writer.endArray();
+}
+
+static void writeAddresses(QCborStreamWriter &writer, const QList<EmailAddress> &addresses)
+{
+    writer.startArray(quint64(addresses.size()));
+    for(const EmailAddress &address : addresses) writeAddress(writer, address);
+    writer.endArray();
+}
+
+static void writeHash(QCborStreamWriter &writer, const QHash<QString, QString> &hash)
+{
+    writer.startMap(quint64(hash.size()));
+
+    for(auto it = hash.constBegin(); it != hash.constEnd(); ++it) {
+        writeString(writer, it.key());
+        writeString(writer, it.value());
+    }
+
+    writer.endMap();
+}
+
+static void writeStrings(QCborStreamWriter &writer, std::initializer_list<QString> strings)
+{
+    for(const QString &str : strings) writeString(writer, str);
+}
+
+QByteArray SendGridMessage::toBinary()
+{
+    QByteArray data;
+    QCborStreamWriter writer(&data);
+
+    writer.startArray(2);
+    writer.append(BinaryVersion);
+    writer.startMap();
+
+    if(from) {
+        writeKey(writer, FromKey);
+        writeAddress(writer, *from);
+    }
+
+    if(!subject.isNull()) {
+        writeKey(writer, SubjectKey);
+        writeString(writer, subject);
+    }
+
+    if(!personalizations.isEmpty())
+    {
+        writeKey(writer, PersonalizationsKey);
+        writer.startArray(quint64(personalizations.size()));
+
+        for(const Personalization &p : qAsConst(personalizations))
+        {
+            writer.startMap();
+
+            if(!p.to.isEmpty()) { writeKey(writer, ToKey); writeAddresses(writer, p.to); }
+            if(!p.cc.isEmpty()) { writeKey(writer, CcKey); writeAddresses(writer, p.cc); }
+            if(!p.bcc.isEmpty()) { writeKey(writer, BccKey); writeAddresses(writer, p.bcc); }
+            if(!p.subject.isNull()) { writeKey(writer, PersonalizationSubjectKey); writeString(writer, p.subject); }
+            if(!p.headers.isEmpty()) { writeKey(writer, PersonalizationHeadersKey); writeHash(writer, p.headers); }
+            if(!p.substitutions.isEmpty()) { writeKey(writer, SubstitutionsKey); writeHash(writer, p.substitutions); }
+            if(!p.customArgs.isEmpty()) { writeKey(writer, PersonalizationCustomArgsKey); writeHash(writer, p.customArgs); }
+            if(p.sendAt) { writeKey(writer, PersonalizationSendAtKey); writer.append(p.sendAt); }
+
+            if(!p.dynamicTemplateData.isEmpty()) {
+                writeKey(writer, DynamicTemplateDataKey);
+                QCborValue::fromJsonValue(p.dynamicTemplateData).toCbor(writer);
+            }
+
+            writer.endMap();
+        }
+
+        writer.endArray();
+    }
+
+    if(!contents.isEmpty())
+    {
+        writeKey(writer, ContentsKey);
+        writer.startArray(quint64(contents.size()));
+
+        for(const Content &content : qAsConst(contents)) {
+            writer.startArray(2);
+            writeUtf8Strings(writer, {content.type, content.value});
+            writer.endArray();
+        }
+
+        writer.endArray();
+    }
+
+    if(!attachments.isEmpty())
+    {
+        writeKey(writer, AttachmentsKey);
+        writer.startArray(quint64(attachments.size()));
+
+        for(const Attachment &attachment : qAsConst(attachments)) {
+            writer.startArray(5);
+            writeUtf8Strings(writer, {attachment.content, attachment.type, attachment.filename, attachment.disposition, attachment.contentId});
+            writer.endArray();
+        }
+
+        writer.endArray();
+    }
+
+    if(!templateId.isNull()) {
+        writeKey(writer, TemplateIdKey);
+        writeString(writer, templateId);
+    }
+
+    if(!headers.isEmpty()) {
+        writeKey(writer, HeadersKey);
+        writeHash(writer, headers);
+    }
+
+    if(!sections.isEmpty()) {
+        writeKey(writer, SectionsKey);
+        writeHash(writer, sections);
+    }
+
+    if(!categories.isEmpty())
+    {
+        writeKey(writer, CategoriesKey);
+        writer.startArray(quint64(categories.size()));
+        for(const QString &category : qAsConst(categories)) writeString(writer, category);
+        writer.endArray();
+    }
+
+    if(!customArgs.isEmpty()) {
+        writeKey(writer, CustomArgsKey);
+        writeHash(writer, customArgs);
+    }
+
+    if(sendAt) {
+        writeKey(writer, SendAtKey);
+        writer.append(sendAt);
+    }
+
+    if(_asm)
+    {
+        writeKey(writer, AsmKey);
+        writer.startArray(2);
+        writer.append(qint64(_asm->groupId));
+        writer.startArray(quint64(_asm->groupsToDisplay.size()));
+        for(int group : _asm->groupsToDisplay) writer.append(qint64(group));
+        writer.endArray();
+        writer.endArray();
+    }
+
+    if(!batchId.isNull()) {
+        writeKey(writer, BatchIdKey);
+        writeString(writer, batchId);
+    }
+
+    if(!ipPoolName.isNull()) {
+        writeKey(writer, IpPoolNameKey);
+        writeString(writer, ipPoolName);
+    }
+
+    if(!mailSettings.isEmpty())
+    {
+        writeKey(writer, MailSettingsKey);
+        writer.startMap();
+
+        if(mailSettings.bccSettings)
+        {
+            writeKey(writer, BccSettingsKey);
+            writer.startArray(2);
+            writer.append(mailSettings.bccSettings->enable);
+            writeString(writer, mailSettings.bccSettings->email);
+            writer.endArray();
+        }
+
+        if(mailSettings.bypassListManagement) {
+            writeKey(writer, BypassListManagementKey);
+            writer.append(mailSettings.bypassListManagement->enable);
+        }
+
+        if(mailSettings.footerSettings)
+        {
+            writeKey(writer, FooterSettingsKey);
+            writer.startArray(3);
+            writer.append(mailSettings.footerSettings->enable);
+            writeStrings(writer, {mailSettings.footerSettings->html, mailSettings.footerSettings->text});
+            writer.endArray();
+        }
+
+        if(mailSettings.sandboxMode) {
+            writeKey(writer, SandboxModeKey);
+            writer.append(mailSettings.sandboxMode->enable);
+        }
+
+        if(mailSettings.spamCheck)
+        {
+            writeKey(writer, SpamCheckKey);
+            writer.startArray(3);
+            writer.append(mailSettings.spamCheck->enable);
+            writer.append(qint64(mailSettings.spamCheck->threshold));
+            writeString(writer, mailSettings.spamCheck->postToUrl);
+            writer.endArray();
+        }
+
+        writer.endMap();
+    }
+
+    if(!trackingSettings.isEmpty())
+    {
+        writeKey(writer, TrackingSettingsKey);
+        writer.startMap();
+
+        if(trackingSettings.clickTracking)
+        {
+            writeKey(writer, ClickTrackingKey);
+            writer.startArray(2);
+            writer.append(trackingSettings.clickTracking->enable);
+            writer.append(trackingSettings.clickTracking->enableText);
+            writer.endArray();
+        }
+
+        if(trackingSettings.openTracking)
+        {
+            writeKey(writer, OpenTrackingKey);
+            writer.startArray(2);
+            writer.append(trackingSettings.openTracking->enable);
+            writeString(writer, trackingSettings.openTracking->substitutionTag);
+            writer.endArray();
+        }
+
+        if(trackingSettings.subscriptionTracking)
+        {
+            const SubscriptionTracking *tracking = trackingSettings.subscriptionTracking.data();
+
+            writeKey(writer, SubscriptionTrackingKey);
+            writer.startArray(4);
+            writer.append(tracking->enable);
+            writeStrings(writer, {tracking->html, tracking->text, tracking->substitutionTag});
+            writer.endArray();
+        }
+
+        if(trackingSettings.ganalytics)
+        {
+            const Ganalytics *ganalytics = trackingSettings.ganalytics.data();
+
+            writeKey(writer, GanalyticsKey);
+            writer.startArray(6);
+            writer.append(ganalytics->enable);
+            writeStrings(writer, {ganalytics->utmCampaign, ganalytics->utmContent, ganalytics->utmMedium,
+                                  ganalytics->utmSource, ganalytics->utmTerm});
+            writer.endArray();
+        }
+
+        writer.endMap();
+    }
+
+    if(replyTo) {
+        writeKey(writer, ReplyToKey);
+        writeAddress(writer, *replyTo);
+    }
+
+    if(localSubstitutions) {
+        writeKey(writer, LocalSubstitutionsKey);
+        writer.append(true);
+    }
+
+    if(normalize) {
+        writeKey(writer, NormalizeKey);
+        writer.append(true);
+    }
+
+    writer.endMap();
+    writer.endArray();
+
+    return data;
+}
+
+// the readers below leave the reader after the value they read, a value of
+// an unexpected type is skipped and read as empty
+
+static QString readString(QCborStreamReader &reader)
+{
+    if(!reader.isString()) {
+        reader.next();
+        return QString();
+    }
+
+    QString str(QLatin1String(""));
+    auto chunk = reader.readString();
+
+    while(chunk.status == QCborStreamReader::Ok) {
+        str += chunk.data;
+        chunk = reader.readString();
+    }
+
+    return str;
+}
+
+// text strings are UTF-8 on the wire already, their chunks are copied as they are
+static QByteArray readUtf8(QCborStreamReader &reader)
+{
+    if(!reader.isString()) {
+        reader.next();
+        return QByteArray();
+    }
+
+    QByteArray utf8("");
+    QCborStreamReader::StringResult<qsizetype> chunk;
+
+    do {
+        qsizetype size = qMax<qsizetype>(0, reader.currentStringChunkSize());
+        int begin = utf8.size();
+
+        utf8.resize(begin + int(size));
+        chunk = reader.readStringChunk(utf8.data() + begin, size);
+        utf8.resize(begin + int(qMax<qsizetype>(0, chunk.data)));
+    } while(chunk.status == QCborStreamReader::Ok);
+
+    return utf8;
+}
+
+static qint64 readInteger(QCborStreamReader &reader)
+{
+    qint64 value = reader.isInteger() ? reader.toInteger() : 0;
+    reader.next();
+
+    return value;
+}
+
+static bool readBool(QCborStreamReader &reader)
+{
+    bool value = reader.isBool() && reader.toBool();
+    reader.next();
+
+    return value;
+}
+
+// calls read for every element of an array, or key and value of a map
+template<typename F> static void readContainer(QCborStreamReader &reader, F read)
+{
+    if(!reader.isContainer()) {
+        reader.next();
+        return;
+    }
+
+    reader.enterContainer();
+    while(reader.hasNext() && reader.lastError() == QCborError::NoError) read();
+    reader.leaveContainer();
+}
+
+static QStringList readStrings(QCborStreamReader &reader)
+{
+    QStringList strings;
+    readContainer(reader, [&]{ strings.append(readString(reader)); });
+
+    return strings;
+}
+
+// an array of at least count strings, padded with null strings
+static QStringList readStrings(QCborStreamReader &reader, int count)
+{
+    QStringList strings = readStrings(reader);
+    while(strings.size() < count) strings.append(QString());
+
+    return strings;
+}
+
+// an array of at least count UTF-8 strings, padded with null ones
+static QByteArrayList readUtf8(QCborStreamReader &reader, int count)
+{
+    QByteArrayList strings;
+    readContainer(reader, [&]{ strings.append(readUtf8(reader)); });
+
+    while(strings.size() < count) strings.append(QByteArray());
+
+    return strings;
+}
+
+static EmailAddress readAddress(QCborStreamReader &reader)
+{
+    QStringList fields = readStrings(reader, 2);
+
+    EmailAddress address;
+    address.email = fields.at(0);
+    address.name = fields.at(1);
+
+    return address;
+}
+
+static QList<EmailAddress> readAddresses(QCborStreamReader &reader)
+{
+    QList<EmailAddress> addresses;
+    readContainer(reader, [&]{ addresses.append(readAddress(reader)); });
+
+    return addresses;
+}
+
+static QHash<QString, QString> readHash(QCborStreamReader &reader)
+{
+    QHash<QString, QString> hash;
+
+    readContainer(reader, [&]{
+        QString key = readString(reader);
+        hash.insert(key, readString(reader));
+    });
+
+    return hash;
+}
+
+// a bool followed by strings, as the settings are written
+static bool readSetting(QCborStreamReader &reader, QStringList &strings, int count)
+{
+    bool enable = false;
+    int index = 0;
+
+    readContainer(reader, [&]{
+        if(index++ == 0) enable = readBool(reader);
+        else strings.append(readString(reader));
+    });
+
+    while(strings.size() < count) strings.append(QString());
+
+    return enable;
+}
+
+static Personalization readPersonalization(QCborStreamReader &reader)
+{
+    Personalization p;
+
+    readContainer(reader, [&]{
+        switch (readInteger(reader)) {
+        case ToKey: p.to = readAddresses(reader); break;
+        case CcKey: p.cc = readAddresses(reader); break;
+        case BccKey: p.bcc = readAddresses(reader); break;
+        case PersonalizationSubjectKey: p.subject = readString(reader); break;
+        case PersonalizationHeadersKey: p.headers = readHash(reader); break;
+        case SubstitutionsKey: p.substitutions = readHash(reader); break;
+        case PersonalizationCustomArgsKey: p.customArgs = readHash(reader); break;
+        case PersonalizationSendAtKey: p.sendAt = readInteger(reader); break;
+        case DynamicTemplateDataKey: p.dynamicTemplateData = QCborValue::fromCbor(reader).toJsonValue().toObject(); break;
+        default: reader.next();
+        }
+    });
+
+    return p;
+}
+
+bool SendGridMessage::fromBinary(const QByteArray &data)
+{
+    QCborStreamReader reader(data);
+
+    if(!reader.isArray()) return false;
+
+    reader.enterContainer();
+
+    if(!reader.hasNext() || readInteger(reader) != BinaryVersion || !reader.isMap()) return false;
+
+    // everything goes through the setters so the running totals add up
+    readContainer(reader, [&]{
+        switch (readInteger(reader)) {
+        case FromKey: setFrom(new EmailAddress(readAddress(reader))); break;
+        case SubjectKey: setSubject(readString(reader)); break;
+
+        case PersonalizationsKey:
+            readContainer(reader, [&]{ addPersonalization(readPersonalization(reader)); });
+            break;
+
+        case ContentsKey:
+            readContainer(reader, [&]{
+                QByteArrayList fields = readUtf8(reader, 2);
+                addContents({ Content::fromUtf8(fields.at(0), fields.at(1)) });
+            });
+            break;
+
+        case AttachmentsKey:
+            readContainer(reader, [&]{
+                QByteArrayList fields = readUtf8(reader, 5);
+                addAttachments({ Attachment {fields.at(0), fields.at(1), fields.at(2), fields.at(3), fields.at(4)} });
+            });
+            break;
+
+        case TemplateIdKey: setTemplateId(readString(reader)); break;
+        case HeadersKey: addHeaders(readHash(reader)); break;
+        case SectionsKey: addSections(readHash(reader)); break;
+        case CategoriesKey: addCategories(readStrings(reader)); break;
+        case CustomArgsKey: addCustomArgs(readHash(reader)); break;
+        case SendAtKey: setSendAt(readInteger(reader)); break;
+
+        case AsmKey: {
+            qint64 groupId = 0;
+            QList<int> groups;
+            int index = 0;
+
+            readContainer(reader, [&]{
+                if(index++ == 0) groupId = readInteger(reader);
+                else readContainer(reader, [&]{ groups.append(int(readInteger(reader))); });
+            });
+
+            setAsm(int(groupId), groups);
+            break;
+        }
+
+        case BatchIdKey: setBatchId(readString(reader)); break;
+        case IpPoolNameKey: setIpPoolName(readString(reader)); break;
+
+        case MailSettingsKey:
+            readContainer(reader, [&]{
+                QStringList s;
+
+                switch (readInteger(reader)) {
+                case BccSettingsKey: {
+                    bool enable = readSetting(reader, s, 1);
+                    setBccSetting(enable, s.at(0));
+                    break;
+                }
+                case BypassListManagementKey: setBypassQListManagement(readBool(reader)); break;
+                case FooterSettingsKey: {
+                    bool enable = readSetting(reader, s, 2);
+                    setFooterSetting(enable, s.at(0), s.at(1));
+                    break;
+                }
+                case SandboxModeKey: setSandBoxMode(readBool(reader)); break;
+                case SpamCheckKey: {
+                    bool enable = false;
+                    qint64 threshold = 1;
+                    QString url;
+                    int index = 0;
+
+                    readContainer(reader, [&]{
+                        switch (index++) {
+                        case 0: enable = readBool(reader); break;
+                        case 1: threshold = readInteger(reader); break;
+                        default: url = readString(reader);
+                        }
+                    });
+
+                    setSpamCheck(enable, int(threshold), url);
+                    break;
+                }
+                default: reader.next();
+                }
+            });
+            break;
+
+        case TrackingSettingsKey:
+            readContainer(reader, [&]{
+                QStringList s;
+
+                switch (readInteger(reader)) {
+                case ClickTrackingKey: {
+                    bool enable = false;
+                    bool enableText = false;
+                    int index = 0;
+
+                    readContainer(reader, [&]{
+                        if(index++ == 0) enable = readBool(reader);
+                        else enableText = readBool(reader);
+                    });
+
+                    setClickTracking(enable, enableText);
+                    break;
+                }
+                case OpenTrackingKey: {
+                    bool enable = readSetting(reader, s, 1);
+                    setOpenTracking(enable, s.at(0));
+                    break;
+                }
+                case SubscriptionTrackingKey: {
+                    bool enable = readSetting(reader, s, 3);
+                    setSubscriptionTracking(enable, s.at(0), s.at(1), s.at(2));
+                    break;
+                }
+                case GanalyticsKey: {
+                    bool enable = readSetting(reader, s, 5);
+                    setGoogleAnalytics(enable, s.at(0), s.at(1), s.at(2), s.at(3), s.at(4));
+                    break;
+                }
+                default: reader.next();
+                }
+            });
+            break;
+
+        case ReplyToKey: setReplyTo(new EmailAddress(readAddress(reader))); break;
+        case LocalSubstitutionsKey: setLocalSubstitutions(readBool(reader)); break;
+        case NormalizeKey: setNormalizeRecipients(readBool(reader)); break;
+        default: reader.next();
+        }
+    });
+
+    return reader.lastError() == QCborError::NoError;
+}
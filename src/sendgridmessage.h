@@ -1,349 +1,943 @@
 #ifndef SENDGRIDMESSAGE_H
 #define SENDGRIDMESSAGE_H
 
-#include <QHash>
 #include <QHash>
 #include "sendgrid.h"
+#include "templaterenderer.h"
+#include "addressnormalizer.h"
+
+#include <QSet>
 
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QJsonValue>
+#include <QCryptographicHash>
+#include <QtEndian>
+
+#include <climits>
+#include <functional>
 
 namespace SendGrid {
 
+enum SendGridMessageError
+{
+    NoMessageError,
+    TooManyPersonalizations,
+    TooManySubstitutions,
+    PersonalizationTooLarge,
+    MessageTooLarge
+};
+
+// renders the payloads of a message with local substitutions one at a time, one
+// per personalization. what they all share is held once, the compiled contents
+// and the serialized attachments and settings, so a payload only takes memory
+// from render() until it is sent. const once built, so it may be shared between
+// threads, see SendGridMessage::payloadRenderer()
+class PayloadRenderer
+{
+public:
+    int count() const
+    {
+        return personalizations.size();
+    }
+
+    // the settings the payloads carry besides recipients, subject, contents and
+    // attachments, which are left out of obj
+    void setObject(QJsonObject obj)
+    {
+        obj.remove("personalizations");
+        obj.remove("content");
+        obj.remove("attachments");
+        obj.remove("subject");
+
+        tail = "}";
+
+        if(!obj.isEmpty()) tail = "," + QJsonDocument(obj).toJson(QJsonDocument::Compact).mid(1);
+    }
+
+    // bytes of the largest payload, near enough, known before any is rendered
+    qint64 maxPayloadSize() const
+    {
+        return largest + attachments.size() + tail.size() + 24;
+    }
+
+    QByteArray render(int index) const
+    {
+        const Personalization &p = personalizations.at(index);
+        const QHash<QString, QString> &substitutions = p.substitutions;
+
+        // the rendered subject replaces the personalization's, the substitutions stay here
+        QString personalSubject;
+        if(!p.subject.isEmpty()) personalSubject = TemplateRenderer(p.subject, substitutions.keys()).render(substitutions);
+
+        QJsonObject personalization = p.toJson();
+        personalization.remove("substitutions");
+
+        if(!personalSubject.isEmpty()) personalization.insert("subject", personalSubject);
+        else personalization.remove("subject");
+
+        QByteArray payload;
+        payload.reserve(int(qMin<qint64>(maxPayloadSize(), INT_MAX)));
+
+        payload += "{\"personalizations\":[";
+        payload += QJsonDocument(personalization).toJson(QJsonDocument::Compact);
+        payload += ']';
+
+        if(personalSubject.isEmpty() && !subject.isEmpty())
+        {
+            payload += ",\"subject\":\"";
+            subjectRenderer.renderJson(substitutions, payload);
+            payload += '"';
+        }
+
+        if(!renderers.isEmpty())
+        {
+            payload += ",\"content\":[";
+
+            for(int i = 0; i < renderers.count(); i++)
+            {
+                if(i) payload += ',';
+
+                payload += "{\"type\":";
+                appendJsonString(payload, contentTypes.at(i));
+                payload += ",\"value\":\"";
+                renderers.at(i).renderJson(substitutions, payload);
+                payload += "\"}";
+            }
+
+            payload += ']';
+        }
+
+        payload += attachments;
+        payload += tail;
+
+        return payload;
+    }
+
+private:
+    friend class SendGridMessage;
+
+    QList<Personalization> personalizations;
+    QString subject;
+    TemplateRenderer subjectRenderer;
+    QByteArrayList contentTypes;
+    QVector<TemplateRenderer> renderers;
+
+    // ,"attachments":[...] or nothing, and the closing part with the settings
+    QByteArray attachments;
+    QByteArray tail;
+
+    qint64 largest = 0;
+};
+
 class SendGridMessage
 {
 public:
     SendGridMessage(){}
 
+    // limits of the v3 mail/send endpoint
+    static const int MaxPersonalizations = 1000;
+    static const int MaxSubstitutions = 100;
+    static const int MaxPersonalizationBytes = 10000;
+    static const qint64 MaxPayloadSize = 30 * 1024 * 1024;
+
+    // a copy that shares content, attachments, settings and everything else with
+    // this message, it costs the size of the object whatever the message holds.
+    // what is then set or added on either one is that message's own, so a variant
+    // per segment only pays for the subject, categories, custom args or recipients
+    // it changes. clearPersonalizations(), clearCategories() and clearCustomArgs()
+    // let a variant replace those instead of adding to the ones it shares. toJson()
+    // keeps the sharing too unless it has an address to fix or contents to reorder
+    SendGridMessage clone() const
+    {
+        return *this;
+    }
+
     void addPersonalization(Personalization personalization)
     {
-        if(!personalizations) personalizations = new QList<Personalization>();
+        this->personalizations.append(personalization);
+
+        payloadSize += personalization.jsonSize() + 1;
+
+        maxSubstitutions = qMax(maxSubstitutions, personalization.substitutions.size());
+        maxSubstitutionBytes = qMax(maxSubstitutionBytes, hashBytes(personalization.substitutions));
+        maxCustomArgsBytes = qMax(maxCustomArgsBytes, hashBytes(personalization.customArgs));
+    }
+
+    QString getTemplateId()
+    {
+        return templateId;
+    }
+
+    QList<Personalization> getPersonalizations()
+    {
+        return personalizations;
+    }
+
+    int personalizationCount()
+    {
+        return personalizations.count();
+    }
+
+    void clearPersonalizations()
+    {
+        for(const Personalization &p : qAsConst(personalizations)) payloadSize -= p.jsonSize() + 1;
 
-        this->personalizations->append(personalization);
+        personalizations.clear();
+
+        maxSubstitutions = 0;
+        maxSubstitutionBytes = 0;
+        maxCustomArgsBytes = 0;
+    }
+
+    // drops every to, cc and bcc address matching suppressed, and personalizations
+    // left without a to address. returns how many addresses were dropped
+    int removeRecipients(std::function<bool(const EmailAddress&)> suppressed)
+    {
+        return editRecipients([&suppressed](Personalization &p){
+            int count = 0;
+
+            for(QList<EmailAddress> *list : {&p.to, &p.cc, &p.bcc})
+            {
+                for(int j = list->size() - 1; j >= 0; j--)
+                {
+                    if(suppressed(list->at(j))) {
+                        list->removeAt(j);
+                        count++;
+                    }
+                }
+            }
+
+            return count;
+        });
+    }
+
+    // trims and checks every recipient address and drops invalid ones and repeats
+    // within a personalization, see AddressNormalizer. returns how many were dropped
+    int normalizeRecipients()
+    {
+        return editRecipients([](Personalization &p){ return AddressNormalizer::normalize(p); });
+    }
+
+    // runs normalizeRecipients() whenever the message is serialized
+    void setNormalizeRecipients(bool enable)
+    {
+        this->normalize = enable;
     }
 
     void setFrom(EmailAddress *email)
     {
-        if(from) delete from;
+        this->from.reset(email);
 
-        this->from = email;
+        account(FromField, email ? email->jsonSize() + 8 : 0);
     }
 
     void setReplyTo(EmailAddress *email)
     {
-        if(replyTo) delete replyTo;
+        this->replyTo.reset(email);
 
-        this->replyTo = email;
+        account(ReplyToField, email ? email->jsonSize() + 12 : 0);
     }
 
     void setSubject(QString subject)
     {
         this->subject = subject;
+
+        account(SubjectField, stringSize(subject, 11));
     }
 
     void AddContent(QString mimeType, QString text)
     {
-        if(!contents) contents = new QList<Content>();
+        addContentUtf8(mimeType.toUtf8(), text.toUtf8());
+    }
+
+    // text that is already UTF-8 is stored as it is
+    void addContentUtf8(QByteArray mimeType, QByteArray text)
+    {
+        this->contents.append(Content::fromUtf8(mimeType, text));
 
-        this->contents->append({ mimeType, text});
+        payloadSize += this->contents.last().jsonSize() + 1;
     }
 
     void addContents(QList<Content> contents)
     {
-        if(!this->contents) this->contents = new QList<Content>();
+        this->contents.append(contents);
 
-        this->contents->append(contents);
+        for(const Content &content : contents) payloadSize += content.jsonSize() + 1;
     }
 
     void addAttachment(QString filename, QString content, QString type = nullptr, QString disposition = nullptr, QString content_id = nullptr)
     {
-        if(!attachments) attachments = new QList<Attachment>();
+        addAttachmentUtf8(filename.toUtf8(), content.toUtf8(), type.toUtf8(), disposition.toUtf8(), content_id.toUtf8());
+    }
+
+    // base64 content read as bytes needs no conversion at all
+    void addAttachmentUtf8(QByteArray filename, QByteArray content, QByteArray type = QByteArray(), QByteArray disposition = QByteArray(), QByteArray content_id = QByteArray())
+    {
+        // in the order Attachment declares its fields
+        this->attachments.append(Attachment {content, type, filename, disposition, content_id});
 
-        this->attachments->append({ filename, content, type, disposition, content_id});
+        payloadSize += this->attachments.last().jsonSize() + 1;
     }
 
     void addAttachments(QList<Attachment> attachments)
     {
-        if(!this->attachments) this->attachments = new QList<Attachment>();
+        this->attachments.append(attachments);
 
-        this->attachments->append(attachments);
+        for(const Attachment &attachment : attachments) payloadSize += attachment.jsonSize() + 1;
     }
 
     void setTemplateId(QString templateID)
     {
         this->templateId = templateID;
+
+        account(TemplateIdField, stringSize(templateID, 15));
     }
 
     void addSection(QString key, QString value)
     {
-        if(!sections) sections = new QHash<QString, QString>();
-
-        this->sections->insert(key, value);
+        insertAccounted(sections, key, value);
     }
 
     void addSections(QHash<QString, QString> sections)
     {
-        if(!this->sections) this->sections = new QHash<QString, QString>();
-
-        this->sections->unite(sections);
+        for(auto it = sections.constBegin(); it != sections.constEnd(); ++it)
+            insertAccounted(this->sections, it.key(), it.value());
     }
 
     void addHeader(QString key, QString value)
     {
-        if(!headers) headers = new QHash<QString, QString>();
-
-        this->headers->insert(key, value);
+        insertAccounted(headers, key, value);
     }
     void addHeaders(QHash<QString, QString> headers)
     {
-        if(!this->headers) this->headers = new QHash<QString, QString>();
-
-        this->headers->unite(headers);
+        for(auto it = headers.constBegin(); it != headers.constEnd(); ++it)
+            insertAccounted(this->headers, it.key(), it.value());
     }
     void addCategory(QString category)
     {
-        if(!this->categories) this->categories = new QList<QString>();
+        this->categories.append(category);
 
-        this->categories->append(category);
+        payloadSize += utf8Size(category) + 3;
     }
 
     void addCategories(QList<QString> categories)
     {
-        if(!this->categories) this->categories = new QList<QString>();
+        this->categories.append(categories);
 
-        this->categories->append(categories);
+        for(const QString &category : categories) payloadSize += utf8Size(category) + 3;
     }
-    void addCustomArg(QString key, QString value)
+
+    void clearCategories()
     {
-        if(!this->customArgs) this->customArgs = new QHash<QString, QString>();
+        for(const QString &category : qAsConst(categories)) payloadSize -= utf8Size(category) + 3;
 
-        this->customArgs->insert(key, value);
+        categories.clear();
+    }
+    void addCustomArg(QString key, QString value)
+    {
+        customArgsBytes += insertAccounted(customArgs, key, value);
     }
 
     void addCustomArgs(QHash<QString, QString> customArgs)
     {
-        if(!this->customArgs) this->customArgs = new QHash<QString, QString>();
+        for(auto it = customArgs.constBegin(); it != customArgs.constEnd(); ++it)
+            customArgsBytes += insertAccounted(this->customArgs, it.key(), it.value());
+    }
+
+    void clearCustomArgs()
+    {
+        for(auto it = customArgs.constBegin(); it != customArgs.constEnd(); ++it)
+            payloadSize -= utf8Size(it.key()) + utf8Size(it.value()) + 6;
 
-        this->customArgs->unite(customArgs);
+        customArgs.clear();
+        customArgsBytes = 0;
     }
 
     void setSendAt(qint64 sendAt)
     {
         this->sendAt = sendAt;
+
+        account(SendAtField, sendAt > 0 ? 22 : 0);
     }
 
     void setBatchId(QString batchId)
     {
         this->batchId = batchId;
+
+        account(BatchIdField, stringSize(batchId, 12));
     }
     void setAsm(int groupID, QList<int> groupsToDisplay)
     {
-        if(this->_asm) delete this->_asm;
+        this->_asm.reset(new ASM {groupID, groupsToDisplay});
 
-        this->_asm = new ASM {groupID, groupsToDisplay};
+        account(AsmField, 48 + 12 * groupsToDisplay.size());
     }
 
     void setIpPoolName(QString ipPoolName)
     {
         this->ipPoolName = ipPoolName;
+
+        account(IpPoolNameField, stringSize(ipPoolName, 16));
     }
 
     void setBccSetting(bool enable, QString email)
     {
-        if(!this->mailSettings) this->mailSettings = new MailSettings();
-
-        if(this->mailSettings->bccSettings) delete this->mailSettings->bccSettings;
-
-        this->mailSettings->bccSettings = new BCCSettings{
+        this->mailSettings.bccSettings.reset(new BCCSettings{
             enable,
             email
-        };
+        });
+
+        account(BccSettingsField, utf8Size(email) + 48);
     }
 
     void setBypassQListManagement(bool enable)
     {
-        if(!this->mailSettings) this->mailSettings = new MailSettings();
-
-        if(this->mailSettings->bypassListManagement) delete this->mailSettings->bypassListManagement;
-
-        this->mailSettings->bypassListManagement = new BypassListManagement{
+        this->mailSettings.bypassListManagement.reset(new BypassListManagement{
             enable
-        };
+        });
+
+        account(BypassListManagementField, 48);
     }
 
     void setFooterSetting(bool enable, QString html = nullptr, QString text = nullptr)
     {
-        if(!this->mailSettings) this->mailSettings = new MailSettings();
-
-        if(this->mailSettings->footerSettings) delete this->mailSettings->footerSettings;
-
-        this->mailSettings->footerSettings = new FooterSettings{
+        this->mailSettings.footerSettings.reset(new FooterSettings{
             enable,
             html,
             text
-        };
+        });
+
+        account(FooterSettingsField, utf8Size(html) + utf8Size(text) + 56);
     }
 
     void setSandBoxMode(bool enable)
     {
-        if(!this->mailSettings) this->mailSettings = new MailSettings();
-        if(this->mailSettings->sandboxMode) delete this->mailSettings->sandboxMode;
-
-        this->mailSettings->sandboxMode = new SandboxMode{
+        this->mailSettings.sandboxMode.reset(new SandboxMode{
             enable
-        };
+        });
+
+        account(SandboxModeField, 36);
     }
 
     void setSpamCheck(bool enable, int threshold = 1, QString postToUrl = nullptr)
     {
-        if(!this->mailSettings) this->mailSettings = new MailSettings();
-
-        if(this->mailSettings->spamCheck) delete this->mailSettings->spamCheck;
-
-        this->mailSettings->spamCheck = new SpamCheck{
+        this->mailSettings.spamCheck.reset(new SpamCheck{
             enable,
             threshold,
             postToUrl
-        };
+        });
+
+        account(SpamCheckField, utf8Size(postToUrl) + 64);
     }
 
     void setClickTracking(bool enable, bool enableText)
     {
-        if(!this->trackingSettings) this->trackingSettings = new TrackingSettings();
-
-        if(this->trackingSettings->clickTracking) delete this->trackingSettings->clickTracking;
-
-        this->trackingSettings->clickTracking = new ClickTracking{
+        this->trackingSettings.clickTracking.reset(new ClickTracking{
             enable,
             enableText
-        };
+        });
+
+        account(ClickTrackingField, 56);
     }
 
     void setOpenTracking(bool enable, QString substitutionTag)
     {
-        if(!this->trackingSettings) this->trackingSettings = new TrackingSettings();
-
-        if(this->trackingSettings->openTracking) delete this->trackingSettings->openTracking;
-
-        this->trackingSettings->openTracking = new OpenTracking{
+        this->trackingSettings.openTracking.reset(new OpenTracking{
             enable,
             substitutionTag
-        };
+        });
+
+        account(OpenTrackingField, utf8Size(substitutionTag) + 56);
     }
 
     void setSubscriptionTracking(bool enable, QString html = nullptr, QString text = nullptr, QString substitutionTag = nullptr)
     {
-        if(!this->trackingSettings) this->trackingSettings = new TrackingSettings();
-
-        if(this->trackingSettings->subscriptionTracking) delete this->trackingSettings->subscriptionTracking;
-
-        this->trackingSettings->subscriptionTracking = new SubscriptionTracking{
+        this->trackingSettings.subscriptionTracking.reset(new SubscriptionTracking{
             enable,
             substitutionTag,
             html,
             text
-        };
+        });
+
+        account(SubscriptionTrackingField, utf8Size(substitutionTag) + utf8Size(html) + utf8Size(text) + 80);
     }
 
     void setGoogleAnalytics(bool enable, QString utmCampaign = nullptr, QString utmContent = nullptr, QString utmMedium = nullptr, QString utmSource = nullptr, QString utmTerm = nullptr)
     {
-        if(!this->trackingSettings) this->trackingSettings = new TrackingSettings();
-
-        if(this->trackingSettings->ganalytics) delete this->trackingSettings->ganalytics;
-
-        this->trackingSettings->ganalytics = new Ganalytics{
+        this->trackingSettings.ganalytics.reset(new Ganalytics{
             enable,
             utmCampaign,
             utmContent,
             utmMedium,
             utmSource,
             utmTerm
-        };
+        });
+
+        account(GanalyticsField, utf8Size(utmCampaign) + utf8Size(utmContent) + utf8Size(utmMedium)
+                + utf8Size(utmSource) + utf8Size(utmTerm) + 120);
+    }
+
+    // substitutions are applied locally instead of by SendGrid, which lifts the
+    // limits on them. every personalization is then sent as its own request
+    void setLocalSubstitutions(bool enable)
+    {
+        this->localSubstitutions = enable;
+    }
+
+    bool hasLocalSubstitutions()
+    {
+        return localSubstitutions;
+    }
+
+    // checks the running totals against the mail/send limits, O(1)
+    SendGridMessageError validate()
+    {
+        if(!localSubstitutions)
+        {
+            if(maxSubstitutions > MaxSubstitutions) return TooManySubstitutions;
+            if(maxSubstitutionBytes > MaxPersonalizationBytes) return PersonalizationTooLarge;
+        }
+
+        // message level custom_args are merged into every personalization
+        if(maxCustomArgsBytes + customArgsBytes > MaxPersonalizationBytes) return PersonalizationTooLarge;
+
+        // checked last, these two can be fixed by splitting the message
+        if(personalizations.count() > MaxPersonalizations && !localSubstitutions)
+            return TooManyPersonalizations;
+        if(payloadSize > MaxPayloadSize) return MessageTooLarge;
+
+        return NoMessageError;
     }
 
-    QByteArray toString()
+    static QByteArray errorString(SendGridMessageError error)
     {
+        switch (error) {
+        case TooManyPersonalizations: return "more than 1000 personalizations";
+        case TooManySubstitutions: return "more than 100 substitutions in a personalization";
+        case PersonalizationTooLarge: return "substitutions or custom args of a personalization exceed 10000 bytes";
+        case MessageTooLarge: return "message exceeds 30 MB";
+        default: return QByteArray();
+        }
+    }
+
+    // estimated size of the serialized message, kept up to date as fields are added
+    qint64 estimatedSize()
+    {
+        return payloadSize;
+    }
+
+    QJsonObject toJson()
+    {
+        QJsonObject obj = toJson(nullptr);
+
+        if(!contents.isEmpty()) obj.insert("content", listToJson2(contents));
+        if(!attachments.isEmpty()) obj.insert("attachments", listToJson2(attachments));
+
+        return obj;
+    }
+
+    // the message without content and attachments, those are written to bodies
+    // instead as JSON members ready to splice into the serialized object, see
+    // withBodies(). they are kept as UTF-8 and never go through QString this way
+    QJsonObject toJson(QByteArray *bodies)
+    {
+        if(normalize) normalizeRecipients();
+
         if (!this->plainTextContent.isEmpty() || !this->htmlContent.isEmpty())
         {
             if (!this->plainTextContent.isEmpty())
-                this->contents->append( { SendGridMimeType::Text, this->plainTextContent} );
+                this->contents.append( { SendGridMimeType::Text, this->plainTextContent} );
 
             if (!this->htmlContent.isEmpty())
-                this->contents->append( { SendGridMimeType::Html,this->htmlContent } );
+                this->contents.append( { SendGridMimeType::Html,this->htmlContent } );
 
             this->plainTextContent = "";
             this->htmlContent = "";
         }
 
-        if (this->contents)
+        if (!this->contents.isEmpty())
         {
+            const QByteArray html = SendGridMimeType::Html.toUtf8();
+            const QByteArray text = SendGridMimeType::Text.toUtf8();
+
+            auto rank = [&html, &text](const Content &content){
+                return content.type == text ? 0 : content.type == html ? 1 : 2;
+            };
+
+            // checked before anything is moved, move() detaches and a clone
+            // would lose the contents it shares even if nothing changed
+            bool ordered = true;
+
+            for (int i = 1; i < this->contents.count() && ordered; i++)
+                ordered = rank(this->contents.at(i - 1)) <= rank(this->contents.at(i));
+
             // MimeType.Text > MimeType.Html > Everything Else
-            for (int i = 0; i < this->contents->count(); i++)
+            for (int i = 1; i < this->contents.count() && !ordered; i++)
             {
-                if ((*this->contents)[i].type == SendGridMimeType::Html)
-                {
-                    auto tempContent = (*this->contents)[i];
-                    this->contents->removeAt(i);
-                    this->contents->insert(0, tempContent);
-                }
-
-                if ((*this->contents)[i].type == SendGridMimeType::Text)
-                {
-                    auto tempContent = (*this->contents)[i];
-                    this->contents->removeAt(i);
-                    this->contents->insert(0, tempContent);
-                }
+                if (this->contents.at(i).type == html) this->contents.move(i, 0);
+                if (this->contents.at(i).type == text) this->contents.move(i, 0);
             }
         }
 
-        QJsonDocument doc;
         QJsonObject obj;
 
         if(from) obj.insert("from", from->toJson());
         if(!subject.isEmpty()) obj.insert("subject", subject);
-        if(personalizations) obj.insert("personalizations", listToJson2(*personalizations));
-        if(contents) obj.insert("content", listToJson2(*contents));
-        if(attachments) obj.insert("attachments", listToJson2(*attachments));
+        if(!personalizations.isEmpty()) obj.insert("personalizations", listToJson2(personalizations));
         if(!templateId.isEmpty()) obj.insert("template_id", templateId);
 
-        if(headers) obj.insert("headers", hashToJson(*headers));
-        if(sections) obj.insert("sections", hashToJson(*sections));
-        if(categories) obj.insert("categories", listToJson(*categories));
-        if(customArgs) obj.insert("custom_args", hashToJson(*customArgs));
+        if(!headers.isEmpty()) obj.insert("headers", hashToJson(headers));
+        if(!sections.isEmpty()) obj.insert("sections", hashToJson(sections));
+        if(!categories.isEmpty()) obj.insert("categories", listToJson(categories));
+        if(!customArgs.isEmpty()) obj.insert("custom_args", hashToJson(customArgs));
         if(sendAt > 0) obj.insert("send_at", sendAt);
         if(_asm) obj.insert("asm", _asm->toJson());
         if(!batchId.isEmpty()) obj.insert("batch_id", batchId);
         if(!ipPoolName.isEmpty()) obj.insert("ip_pool_name", ipPoolName);
-        if(mailSettings) obj.insert("mail_settings", mailSettings->toJson());
-        if(trackingSettings) obj.insert("tracking_settings", trackingSettings->toJson());
+        if(!mailSettings.isEmpty()) obj.insert("mail_settings", mailSettings.toJson());
+        if(!trackingSettings.isEmpty()) obj.insert("tracking_settings", trackingSettings.toJson());
         if(replyTo) obj.insert("reply_to", replyTo->toJson());
 
-        doc.setObject(obj);
-        return doc.toJson();
+        if(bodies)
+        {
+            qint64 size = 32;
+
+            for(const Attachment &attachment : qAsConst(attachments)) size += attachment.jsonSize() + 1;
+            for(const Content &content : qAsConst(contents)) size += content.jsonSize() + 1;
+
+            bodies->clear();
+            bodies->reserve(int(qMin<qint64>(size, INT_MAX)));
+
+            if(!attachments.isEmpty()) writeAttachments(*bodies);
+
+            if(!contents.isEmpty())
+            {
+                if(!bodies->isEmpty()) *bodies += ',';
+                *bodies += "\"content\":[";
+
+                for(int i = 0; i < contents.count(); i++) {
+                    if(i) *bodies += ',';
+                    contents.at(i).writeJson(*bodies);
+                }
+
+                *bodies += ']';
+            }
+        }
+
+        return obj;
+    }
+
+    // a compact serialization of the object toJson(bodies) returned, with bodies put back in
+    static QByteArray withBodies(const QByteArray &compact, const QByteArray &bodies)
+    {
+        if(bodies.isEmpty()) return compact;
+
+        QByteArray out;
+        out.reserve(compact.size() + bodies.size() + 1);
+
+        out += '{';
+        out += bodies;
+
+        if(compact.size() > 2) out += ',';
+        out.append(compact.constData() + 1, compact.size() - 1);
+
+        return out;
+    }
+
+    // the compact request body, content and attachments copied in as they are stored
+    QByteArray toPayload()
+    {
+        QByteArray bodies;
+        QJsonObject obj = toJson(&bodies);
+
+        return withBodies(QJsonDocument(obj).toJson(QJsonDocument::Compact), bodies);
+    }
+
+    QByteArray toString(QJsonDocument::JsonFormat format = QJsonDocument::Indented)
+    {
+        return QJsonDocument(toJson()).toJson(format);
+    }
+
+    // a CBOR snapshot of the whole message, settings included, for handing it to
+    // another process or storing it. unlike toJson() it leaves the message as it is
+    QByteArray toBinary();
+
+    // restores a snapshot into an empty message, false if data is not one
+    bool fromBinary(const QByteArray &data);
+
+    // what renders one payload per personalization with subject and contents
+    // substituted locally. contents are compiled once and everything else is
+    // serialized once, obj is what toJson() returned, possibly amended by the caller
+    PayloadRenderer payloadRenderer(const QJsonObject &obj)
+    {
+        PayloadRenderer renderer;
+
+        renderer.personalizations = personalizations;
+        renderer.subject = subject;
+        renderer.setObject(obj);
+
+        // shared by every payload, written once from the stored bytes
+        if(!attachments.isEmpty())
+        {
+            renderer.attachments = ",";
+            writeAttachments(renderer.attachments);
+        }
+
+        QStringList tags;
+        QSet<QString> seen;
+        qint64 largest = 0;
+
+        for(const Personalization &p : qAsConst(personalizations))
+        {
+            for(auto it = p.substitutions.constBegin(); it != p.substitutions.constEnd(); ++it)
+            {
+                if(seen.contains(it.key())) continue;
+
+                seen.insert(it.key());
+                tags.append(it.key());
+            }
+
+            largest = qMax(largest, p.jsonSize());
+        }
+
+        renderer.subjectRenderer = TemplateRenderer(subject, tags);
+
+        largest += utf8Size(subject) + 16;
+
+        for(const Content &content : qAsConst(contents))
+        {
+            renderer.contentTypes.append(content.type);
+            renderer.renderers.append(TemplateRenderer(content.value, tags));
+
+            largest += content.jsonSize() + 1;
+        }
+
+        renderer.largest = largest;
+
+        return renderer;
+    }
+
+    // every payload of payloadRenderer() at once
+    QByteArrayList renderPayloads(const QJsonObject &obj)
+    {
+        PayloadRenderer renderer = payloadRenderer(obj);
+        QByteArrayList payloads;
+
+        for(int i = 0; i < renderer.count(); i++) payloads.append(renderer.render(i));
+
+        return payloads;
+    }
+
+    // identifies messages that only differ in their recipients and schedule, and
+    // in the fingerprint injected into custom_args under injectedKey if given
+    QByteArray contentKey()
+    {
+        QByteArray bodies;
+        QJsonObject obj = toJson(&bodies);
+
+        return contentKey(obj, bodies);
+    }
+
+    static QByteArray contentKey(QJsonObject obj, const QByteArray &bodies = QByteArray(), const QString &injectedKey = QString())
+    {
+        obj.remove("personalizations");
+        obj.remove("send_at");
+        obj.remove("batch_id");
+
+        QJsonObject args = obj.value("custom_args").toObject();
+
+        if(!injectedKey.isEmpty() && args.contains(injectedKey))
+        {
+            args.remove(injectedKey);
+
+            if(args.isEmpty()) obj.remove("custom_args");
+            else obj.insert("custom_args", args);
+        }
+
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+        hash.addData(bodies);
+
+        return hash.result();
+    }
+
+    // stable over retries and replays, QJsonObject keeps its keys sorted so the
+    // same message always serializes the same. a fingerprint that was already
+    // injected into custom_args is left out
+    static quint64 fingerprint(QJsonObject obj, const QString &injectedKey, const QByteArray &bodies = QByteArray())
+    {
+        QJsonObject args = obj.value("custom_args").toObject();
+
+        if(args.contains(injectedKey))
+        {
+            args.remove(injectedKey);
+
+            if(args.isEmpty()) obj.remove("custom_args");
+            else obj.insert("custom_args", args);
+        }
+
+        QCryptographicHash sha1(QCryptographicHash::Sha1);
+        sha1.addData(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+        sha1.addData(bodies);
+
+        QByteArray hash = sha1.result();
+
+        return qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(hash.constData()));
     }
 
 private:
-    EmailAddress *from = nullptr;
+    // fields that are replaced rather than appended to, their last size is
+    // kept so it can be taken out of the total again
+    enum AccountedField
+    {
+        FromField,
+        ReplyToField,
+        SubjectField,
+        TemplateIdField,
+        SendAtField,
+        BatchIdField,
+        AsmField,
+        IpPoolNameField,
+        BccSettingsField,
+        BypassListManagementField,
+        FooterSettingsField,
+        SandboxModeField,
+        SpamCheckField,
+        ClickTrackingField,
+        OpenTrackingField,
+        SubscriptionTrackingField,
+        GanalyticsField,
+        AccountedFieldCount
+    };
+
+    // edit changes the recipients of one personalization and returns how many it
+    // dropped, the totals are brought up to date and emptied personalizations removed
+    template<typename F> int editRecipients(F edit)
+    {
+        if(personalizations.isEmpty()) return 0;
+
+        int removed = 0;
+
+        maxSubstitutions = 0;
+        maxSubstitutionBytes = 0;
+        maxCustomArgsBytes = 0;
+
+        for(int i = personalizations.size() - 1; i >= 0; i--)
+        {
+            // edited on a copy and written back only if it changed, so a clone
+            // keeps sharing personalizations that had nothing to edit
+            const Personalization &original = personalizations.at(i);
+            Personalization p = original;
+
+            removed += edit(p);
+
+            if(p.to.isEmpty()) {
+                payloadSize -= original.jsonSize() + 1;
+                personalizations.removeAt(i);
+                continue;
+            }
+
+            if(!p.to.isSharedWith(original.to) || !p.cc.isSharedWith(original.cc) || !p.bcc.isSharedWith(original.bcc))
+            {
+                payloadSize += p.jsonSize() - original.jsonSize();
+                personalizations[i] = p;
+            }
+
+            maxSubstitutions = qMax(maxSubstitutions, p.substitutions.size());
+            maxSubstitutionBytes = qMax(maxSubstitutionBytes, hashBytes(p.substitutions));
+            maxCustomArgsBytes = qMax(maxCustomArgsBytes, hashBytes(p.customArgs));
+        }
+
+        return removed;
+    }
+
+    void writeAttachments(QByteArray &out)
+    {
+        out += "\"attachments\":[";
+
+        for(int i = 0; i < attachments.count(); i++) {
+            if(i) out += ',';
+            attachments.at(i).writeJson(out);
+        }
+
+        out += ']';
+    }
+
+    void account(AccountedField field, qint64 size)
+    {
+        payloadSize += size - fieldSizes[field];
+        fieldSizes[field] = size;
+    }
+
+    static qint64 stringSize(const QString &str, int keySize)
+    {
+        return str.isEmpty() ? 0 : utf8Size(str) + keySize;
+    }
+
+    // bytes of keys and values, as the per personalization limits count them
+    static int hashBytes(const QHash<QString, QString> &hash)
+    {
+        qint64 size = 0;
+
+        for(auto it = hash.constBegin(); it != hash.constEnd(); ++it)
+            size += utf8Size(it.key()) + utf8Size(it.value());
+
+        return int(qMin<qint64>(size, INT_MAX));
+    }
+
+    // inserts into one of the string hashes, returns the change in key and value bytes
+    int insertAccounted(QHash<QString, QString> &hash, const QString &key, const QString &value)
+    {
+        qint64 before = 0;
+        auto it = hash.constFind(key);
+
+        if(it != hash.constEnd()) {
+            before = utf8Size(key) + utf8Size(it.value());
+            payloadSize -= before + 6;
+        }
+
+        hash.insert(key, value);
+
+        qint64 after = utf8Size(key) + utf8Size(value);
+        payloadSize += after + 6;
+
+        return int(after - before);
+    }
+
+    bool localSubstitutions = false;
+    bool normalize = false;
+
+    qint64 payloadSize = 2;
+    qint64 fieldSizes[AccountedFieldCount] = {};
+    int maxSubstitutions = 0;
+    int maxSubstitutionBytes = 0;
+    int maxCustomArgsBytes = 0;
+    int customArgsBytes = 0;
+
+    // the containers are implicitly shared and the other fields are replaced
+    // whole by their setters, never changed in place, so a copy shares all of
+    // them and only takes its own of what is then changed on it, see clone()
+    QSharedPointer<EmailAddress> from;
     QString subject;
-    QList<Personalization> *personalizations = nullptr;
-    QList<Content> *contents = nullptr;
+    QList<Personalization> personalizations;
+    QList<Content> contents;
     QString plainTextContent;
     QString htmlContent;
-    QList<Attachment> *attachments = nullptr;
+    QList<Attachment> attachments;
     QString templateId;
-    QHash<QString, QString> *headers = nullptr;
-    QHash<QString, QString> *sections = nullptr;
-    QList<QString> *categories = nullptr;
-    QHash<QString, QString> *customArgs = nullptr;
+    QHash<QString, QString> headers;
+    QHash<QString, QString> sections;
+    QList<QString> categories;
+    QHash<QString, QString> customArgs;
     qint64 sendAt = 0;
-    ASM *_asm = nullptr;
+    QSharedPointer<ASM> _asm;
     QString batchId;
     QString ipPoolName;
-    MailSettings *mailSettings = nullptr;
-    TrackingSettings *trackingSettings = nullptr;
-    EmailAddress *replyTo = nullptr;
+    MailSettings mailSettings;
+    TrackingSettings trackingSettings;
+    QSharedPointer<EmailAddress> replyTo;
 };
 
 }
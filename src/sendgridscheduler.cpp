@@ -0,0 +1,179 @@
+#include "sendgridscheduler.h"
+
+#include <QDateTime>
+
+using namespace SendGrid;
+
+SendGridScheduler::SendGridScheduler(SendGridClient *client, QObject *parent):
+    QObject(parent),
+    client {client},
+    wheel {QDateTime::currentSecsSinceEpoch()}
+{
+    client->registerEndpoint("/mail/batch");
+
+    timer.setInterval(1000);
+    connect(&timer, &QTimer::timeout, this, &SendGridScheduler::tick);
+}
+
+SendGridScheduler::~SendGridScheduler()
+{
+    // what was never released gives its share of the budget back
+    for(const Group &group : qAsConst(groups)) client->releaseMemory(group.size);
+}
+
+quint64 SendGridScheduler::schedule(SendGridMessage &msg, qint64 sendAt)
+{
+    msg.setSendAt(sendAt);
+    msg.setBatchId(QString());
+
+    // the same suppression filtering and template check as sendEmail, a message
+    // refused now would only be refused by SendGrid at release
+    PreparedMessage prepared = client->prepare(msg);
+    QByteArray rejection = prepared.rejection;
+
+    if(rejection.isEmpty() && prepared.validation != NoMessageError && !prepared.split)
+        rejection = SendGridMessage::errorString(prepared.validation);
+
+    if(rejection.isEmpty() && !client->chargeMemory(prepared.size))
+        rejection = "memory budget exceeded";
+
+    if(!rejection.isEmpty()) {
+        emit error(rejection);
+        return 0;
+    }
+
+    qint64 window = sendAt / coalescingWindow;
+    QByteArray key = SendGridMessage::contentKey(prepared.obj, prepared.bodies, SendGridClient::IdempotencyKey) + QByteArray::number(window);
+
+    quint64 id = openGroups.value(key);
+
+    if(!id)
+    {
+        // an idle wheel lags behind, catch it up before inserting relative to it
+        wheel.reset(QDateTime::currentSecsSinceEpoch());
+
+        id = ++lastGroup;
+
+        groups.insert(id, {key, {}, 0});
+        openGroups.insert(key, id);
+        wheel.insert(window * coalescingWindow - releaseAhead, id);
+
+        if(!timer.isActive()) timer.start();
+    }
+
+    Group &group = groups[id];
+    group.messages.append(prepared);
+    group.size += prepared.size;
+    m_pending++;
+
+    return id;
+}
+
+void SendGridScheduler::unschedule(quint64 group)
+{
+    // its wheel entry stays behind and is ignored when it expires
+    Group g = groups.take(group);
+
+    openGroups.remove(g.key);
+    m_pending -= g.messages.size();
+    client->releaseMemory(g.size);
+}
+
+void SendGridScheduler::setCoalescingWindow(int seconds){
+    if(seconds > 0) coalescingWindow = seconds;
+}
+
+void SendGridScheduler::setReleaseAhead(int seconds){
+    releaseAhead = qBound(0, seconds, 72 * 3600);
+}
+
+int SendGridScheduler::pending(){
+    return m_pending;
+}
+
+void SendGridScheduler::tick()
+{
+    wheel.advance(QDateTime::currentSecsSinceEpoch(), [this](quint64 id){
+        release(id);
+    });
+
+    if(wheel.isEmpty()) timer.stop();
+}
+
+void SendGridScheduler::release(quint64 id)
+{
+    if(!groups.contains(id)) return;
+
+    Group group = groups.take(id);
+    openGroups.remove(group.key);
+    m_pending -= group.messages.size();
+
+    client->post("/mail/batch", QByteArray(), [this, group](const Gurra::RestResponse &response){
+
+        QByteArray batchId = QJsonDocument::fromJson(response.data).object().value("batch_id").toString().toUtf8();
+
+        if(!response.isSuccess() || batchId.isEmpty())
+        {
+            // keep the group and try again in a minute, its key stays closed
+            // so the retry cannot swallow messages of a newer group
+            emit error(response.data);
+
+            quint64 retry = ++lastGroup;
+            groups.insert(retry, {QByteArray(), group.messages, group.size});
+            wheel.insert(QDateTime::currentSecsSinceEpoch() + 60, retry);
+            m_pending += group.messages.size();
+
+            if(!timer.isActive()) timer.start();
+            return;
+        }
+
+        // sendPrepared charges each message again while it is in flight
+        client->releaseMemory(group.size);
+
+        for(PreparedMessage prepared : qAsConst(group.messages))
+        {
+            prepared.obj.insert("batch_id", QString(batchId));
+
+            // locally rendered payloads take their settings from obj as well
+            if(prepared.local)
+            {
+                PayloadRenderer renderer = *prepared.renderer;
+                renderer.setObject(prepared.obj);
+                prepared.renderer = QSharedPointer<const PayloadRenderer>::create(renderer);
+            }
+
+            client->sendPrepared(prepared, [this](const Gurra::RestResponse &response){
+                if(!response.isSuccess()) emit error(response.error.isEmpty() ? response.data : response.error);
+            });
+        }
+
+        emit released(QString(batchId), group.messages.size());
+    });
+}
+
+void SendGridScheduler::cancel(QString batchId){
+    setBatchStatus(batchId, "cancel");
+}
+
+void SendGridScheduler::pause(QString batchId){
+    setBatchStatus(batchId, "pause");
+}
+
+void SendGridScheduler::resume(QString batchId)
+{
+    client->remove("/user/scheduled_sends/" + batchId.toUtf8(), [this](const Gurra::RestResponse &response){
+        if(!response.isSuccess()) emit error(response.data);
+    });
+}
+
+void SendGridScheduler::setBatchStatus(QString batchId, QByteArray status)
+{
+    QJsonObject obj {
+        {"batch_id", batchId},
+        {"status", QString(status)}
+    };
+
+    client->post("/user/scheduled_sends", QJsonDocument(obj).toJson(QJsonDocument::Compact), [this](const Gurra::RestResponse &response){
+        if(!response.isSuccess()) emit error(response.data);
+    });
+}
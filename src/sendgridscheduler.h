@@ -0,0 +1,74 @@
+#ifndef SENDGRIDSCHEDULER_H
+#define SENDGRIDSCHEDULER_H
+
+#include "sendgrid/sendgridclient.h"
+#include "sendgrid/timingwheel.h"
+
+#include <QObject>
+#include <QTimer>
+
+namespace SendGrid {
+
+class SendGridScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    SendGridScheduler(SendGridClient *client, QObject *parent = nullptr);
+    ~SendGridScheduler();
+
+    // holds msg until sendAt is within reach of SendGrid, messages with the same content
+    // and a send_at in the same coalescing window are released together under one batch id.
+    // returns the group msg joined, the group can be dropped with unschedule() until released.
+    // held messages count against the client's memory budget and are sent through it at
+    // release, so they are deduplicated and split like any other. a message the client
+    // would refuse, or that doesn't fit the budget, is reported through error() and 0 returned
+    quint64 schedule(SendGridMessage &msg, qint64 sendAt);
+    void unschedule(quint64 group);
+
+    // width in seconds of the send_at windows messages are coalesced in
+    void setCoalescingWindow(int seconds);
+
+    // how long before its window a group is handed to SendGrid, at most 72 hours
+    void setReleaseAhead(int seconds);
+
+    int pending();
+
+    // act on released batches at SendGrid
+    void cancel(QString batchId);
+    void pause(QString batchId);
+    void resume(QString batchId);
+
+signals:
+    void released(QString batchId, int count);
+    void error(const QByteArray err);
+
+private slots:
+    void tick();
+
+private:
+    struct Group
+    {
+        QByteArray key;
+        QList<PreparedMessage> messages;
+        qint64 size;
+    };
+
+    void release(quint64 id);
+    void setBatchStatus(QString batchId, QByteArray status);
+
+    SendGridClient *client;
+
+    Gurra::TimingWheel<quint64> wheel;
+    QHash<quint64, Group> groups;
+    QHash<QByteArray, quint64> openGroups;
+    quint64 lastGroup = 0;
+
+    QTimer timer;
+    int coalescingWindow = 300;
+    int releaseAhead = 3600;
+    int m_pending = 0;
+};
+
+}
+#endif // SENDGRIDSCHEDULER_H
@@ -0,0 +1,94 @@
+#include "sendgridsubmitter.h"
+
+using namespace SendGrid;
+
+SendGridSubmitter::SendGridSubmitter(QByteArray apiKey, QByteArray host):
+    apiKey {apiKey},
+    host {host},
+    worker {new QObject}
+{
+    // the client, and with it its QNetworkAccessManager, is created on the network
+    // thread by the first drain, everything there is deleted with the worker
+    worker->moveToThread(&thread);
+    connect(&thread, &QThread::finished, worker, &QObject::deleteLater);
+
+    thread.setObjectName("SendGridSubmitter");
+    thread.start();
+}
+
+SendGridSubmitter::~SendGridSubmitter()
+{
+    thread.quit();
+    thread.wait();
+}
+
+void SendGridSubmitter::submit(SendGridMessage &msg, Gurra::RestHandler handler)
+{
+    queue.push({SendGridClient::prepare(msg, fingerprint.load(std::memory_order_relaxed), suppressions.load(std::memory_order_acquire),
+                                        templates.load(std::memory_order_acquire)), handler});
+
+    // only the submission that finds the queue empty wakes the network thread
+    if(m_pending.fetch_add(1, std::memory_order_acq_rel) == 0) wake();
+}
+
+void SendGridSubmitter::configure(std::function<void(SendGridClient &client)> fn)
+{
+    QMetaObject::invokeMethod(worker, [this, fn](){
+        fn(*client());
+    }, Qt::QueuedConnection);
+}
+
+void SendGridSubmitter::setDeduplicationWindow(qint64 seconds, int capacity)
+{
+    fingerprint.store(seconds > 0, std::memory_order_relaxed);
+
+    configure([seconds, capacity](SendGridClient &client){
+        client.setDeduplicationWindow(seconds, capacity);
+    });
+}
+
+void SendGridSubmitter::setSuppressionCache(SuppressionCache *cache){
+    suppressions.store(cache, std::memory_order_release);
+}
+
+void SendGridSubmitter::setTemplateRegistry(TemplateRegistry *registry){
+    templates.store(registry, std::memory_order_release);
+}
+
+int SendGridSubmitter::pending(){
+    return m_pending.load(std::memory_order_relaxed);
+}
+
+void SendGridSubmitter::wake()
+{
+    QMetaObject::invokeMethod(worker, [this](){
+        drain();
+    }, Qt::QueuedConnection);
+}
+
+SendGridClient *SendGridSubmitter::client()
+{
+    if(!m_client) {
+        m_client = new SendGridClient(apiKey, host);
+        m_client->setParent(worker);
+    }
+
+    return m_client;
+}
+
+void SendGridSubmitter::drain()
+{
+    Submission submission;
+    int taken = 0;
+
+    while(taken < DrainBatch && queue.pop(submission))
+    {
+        client()->sendPrepared(submission.prepared, submission.handler);
+        submission = Submission();
+        taken++;
+    }
+
+    // what is left was pushed without a wakeup, since the count never reached
+    // zero, or is a batch cut short to keep the event loop responsive
+    if(m_pending.fetch_sub(taken, std::memory_order_acq_rel) - taken > 0) wake();
+}
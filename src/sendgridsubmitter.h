@@ -0,0 +1,74 @@
+#ifndef SENDGRIDSUBMITTER_H
+#define SENDGRIDSUBMITTER_H
+
+#include "sendgrid/sendgridclient.h"
+#include "sendgrid/mpscqueue.h"
+
+#include <QObject>
+#include <QThread>
+
+#include <atomic>
+#include <functional>
+
+namespace SendGrid {
+
+// thread safe front of a SendGridClient that runs on its own network thread.
+// submissions go through a lock free queue drained in batches by that thread,
+// which is only woken when the queue goes from empty to non empty
+class SendGridSubmitter : public QObject
+{
+    Q_OBJECT
+
+public:
+    SendGridSubmitter(QByteArray apiKey, QByteArray host = "https://api.sendgrid.com/v3");
+    ~SendGridSubmitter();
+
+    // any thread. the message is checked and serialized on the calling thread,
+    // handler is called on the network thread
+    void submit(SendGridMessage &msg, Gurra::RestHandler handler = nullptr);
+
+    // runs fn with the client on the network thread, e.g. to add api keys
+    void configure(std::function<void(SendGridClient &client)> fn);
+
+    // same as SendGridClient::setDeduplicationWindow, fingerprints are then
+    // computed by the submitting threads
+    void setDeduplicationWindow(qint64 seconds, int capacity = 1 << 20);
+
+    // same as on SendGridClient, recipients are filtered and templates checked
+    // by the submitting threads. neither is owned
+    void setSuppressionCache(SuppressionCache *cache);
+    void setTemplateRegistry(TemplateRegistry *registry);
+
+    int pending();
+
+private:
+    struct Submission
+    {
+        PreparedMessage prepared;
+        Gurra::RestHandler handler;
+    };
+
+    // network thread only
+    void drain();
+    SendGridClient *client();
+
+    void wake();
+
+    static const int DrainBatch = 256;
+
+    QByteArray apiKey;
+    QByteArray host;
+
+    QThread thread;
+    QObject *worker;
+    SendGridClient *m_client = nullptr;
+
+    MpscQueue<Submission> queue;
+    std::atomic<int> m_pending {0};
+    std::atomic<bool> fingerprint {false};
+    std::atomic<SuppressionCache *> suppressions {nullptr};
+    std::atomic<TemplateRegistry *> templates {nullptr};
+};
+
+}
+#endif // SENDGRIDSUBMITTER_H
@@ -0,0 +1,396 @@
+#include "suppressioncache.h"
+
+#include <QDateTime>
+
+#include <cstring>
+
+using namespace SendGrid;
+
+static const quint32 Magic = 0x53475343; // "SGSC"
+static const quint32 Version = 2;
+static const quint64 InitialCapacity = 1 << 16;
+
+static const char *Lists[] = {
+    "/suppression/bounces",
+    "/suppression/blocks",
+    "/suppression/spam_reports",
+    "/suppression/unsubscribes"
+};
+
+SuppressionCache::SuppressionCache(Gurra::RestConsumer *consumer, QString storage, QObject *parent):
+    QObject(parent),
+    consumer {consumer},
+    file {storage}
+{
+    if(!open()) qDebug() << "SuppressionCache: couldn't open" << storage;
+}
+
+SuppressionCache::~SuppressionCache()
+{
+    if(header) file.unmap(reinterpret_cast<uchar *>(header));
+}
+
+bool SuppressionCache::isOpen()
+{
+    QReadLocker locker(&lock);
+    return header;
+}
+
+int SuppressionCache::count()
+{
+    QReadLocker locker(&lock);
+    return header ? int(header->count) : 0;
+}
+
+void SuppressionCache::setFullSyncInterval(int seconds){
+    fullSyncInterval = qMax(0, seconds);
+}
+
+quint64 SuppressionCache::hashEmail(const QString &email)
+{
+    // FNV-1a over the trimmed, lowercased address, without building either string
+    int begin = 0;
+    int end = email.size();
+
+    while(begin < end && email.at(begin).isSpace()) begin++;
+    while(end > begin && email.at(end - 1).isSpace()) end--;
+
+    quint64 h = 14695981039346656037ULL;
+
+    for(int i = begin; i < end; i++)
+    {
+        ushort c = email.at(i).toLower().unicode();
+
+        h ^= c & 0xff;
+        h *= 1099511628211ULL;
+        h ^= c >> 8;
+        h *= 1099511628211ULL;
+    }
+
+    // spread the bits, probing and the Bloom filter use different parts of them
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    // 0 marks an empty slot
+    return h ? h : 1;
+}
+
+bool SuppressionCache::open()
+{
+    if(!file.open(QIODevice::ReadWrite)) return false;
+
+    if(file.size() >= qint64(sizeof(Header)))
+    {
+        Header stored;
+        file.read(reinterpret_cast<char *>(&stored), sizeof(Header));
+
+        bool valid = stored.magic == Magic && stored.version == Version && stored.capacity
+                && (stored.capacity & (stored.capacity - 1)) == 0
+                && file.size() == qint64(sizeof(Header) + stored.capacity * sizeof(quint64));
+
+        if(valid) return map(stored.capacity, false);
+    }
+
+    return map(InitialCapacity, true);
+}
+
+bool SuppressionCache::map(quint64 capacity, bool reset)
+{
+    if(header) file.unmap(reinterpret_cast<uchar *>(header));
+
+    header = nullptr;
+    slots = nullptr;
+
+    qint64 size = qint64(sizeof(Header) + capacity * sizeof(quint64));
+
+    if(reset || file.size() != size) {
+        if(!file.resize(size)) return false;
+    }
+
+    uchar *memory = file.map(0, size);
+    if(!memory) return false;
+
+    header = reinterpret_cast<Header *>(memory);
+    slots = reinterpret_cast<quint64 *>(memory + sizeof(Header));
+
+    if(reset)
+    {
+        std::memset(memory, 0, size_t(size));
+
+        header->magic = Magic;
+        header->version = Version;
+        header->capacity = capacity;
+    }
+
+    bloomReset();
+
+    for(quint64 i = 0; i < header->capacity; i++)
+        if(slots[i]) bloomInsert(slots[i]);
+
+    return true;
+}
+
+void SuppressionCache::grow()
+{
+    QVector<quint64> entries;
+    entries.reserve(int(header->count));
+
+    for(quint64 i = 0; i < header->capacity; i++)
+        if(slots[i]) entries.append(slots[i]);
+
+    Header kept = *header;
+
+    // reported by insert() once the lock is released
+    if(!map(header->capacity * 2, true)) return;
+
+    std::memcpy(header->lastSync, kept.lastSync, sizeof(kept.lastSync));
+    header->lastFullSync = kept.lastFullSync;
+
+    for(quint64 hash : entries) tableInsert(hash);
+}
+
+void SuppressionCache::clear()
+{
+    QWriteLocker locker(&lock);
+    if(header) map(InitialCapacity, true);
+}
+
+void SuppressionCache::bloomReset()
+{
+    // about 16 bits per slot of the table, a few percent false positives at full load
+    quint64 bits = 64;
+    while(bits < header->capacity * 16) bits <<= 1;
+
+    bloom.fill(0, int(bits / 64));
+    bloomMask = bits - 1;
+}
+
+void SuppressionCache::bloomInsert(quint64 hash)
+{
+    quint64 step = (hash >> 32) | 1;
+
+    for(int k = 0; k < 4; k++, hash += step)
+        bloom[int((hash & bloomMask) >> 6)] |= quint64(1) << (hash & 63);
+}
+
+bool SuppressionCache::bloomContains(quint64 hash)
+{
+    quint64 step = (hash >> 32) | 1;
+
+    for(int k = 0; k < 4; k++, hash += step)
+        if(!(bloom.at(int((hash & bloomMask) >> 6)) & (quint64(1) << (hash & 63)))) return false;
+
+    return true;
+}
+
+bool SuppressionCache::tableContains(quint64 hash)
+{
+    quint64 mask = header->capacity - 1;
+
+    for(quint64 i = hash & mask; slots[i]; i = (i + 1) & mask)
+        if(slots[i] == hash) return true;
+
+    return false;
+}
+
+void SuppressionCache::tableInsert(quint64 hash)
+{
+    quint64 mask = header->capacity - 1;
+    quint64 i = hash & mask;
+
+    for(; slots[i]; i = (i + 1) & mask)
+        if(slots[i] == hash) return;
+
+    slots[i] = hash;
+    header->count++;
+
+    bloomInsert(hash);
+}
+
+void SuppressionCache::tableRemove(quint64 hash)
+{
+    quint64 mask = header->capacity - 1;
+    quint64 i = hash & mask;
+
+    for(; slots[i] != hash; i = (i + 1) & mask)
+        if(!slots[i]) return;
+
+    // backward shift, entries after the hole move up unless that would put them
+    // before their home slot, so probes never stop short of them. the Bloom
+    // filter keeps its bits, the table has the last word anyway
+    for(quint64 j = (i + 1) & mask; slots[j]; j = (j + 1) & mask)
+    {
+        quint64 home = slots[j] & mask;
+        bool between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+
+        if(!between) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i] = 0;
+    header->count--;
+}
+
+bool SuppressionCache::contains(const QString &email)
+{
+    QReadLocker locker(&lock);
+
+    if(!header) return false;
+
+    quint64 hash = hashEmail(email);
+
+    return bloomContains(hash) && tableContains(hash);
+}
+
+void SuppressionCache::insert(const QString &email)
+{
+    quint64 hash = hashEmail(email);
+
+    {
+        QWriteLocker locker(&lock);
+
+        if(!header) return;
+
+        if(fullSync) seen.insert(hash);
+
+        // keep the table at most 70% full so probes stay short
+        if((header->count + 1) * 10 > header->capacity * 7) grow();
+
+        if(header)
+        {
+            quint64 before = header->count;
+
+            tableInsert(hash);
+
+            if(header->count != before) added++;
+            return;
+        }
+    }
+
+    emit error("SuppressionCache: couldn't grow storage");
+}
+
+void SuppressionCache::remove(const QString &email)
+{
+    quint64 hash = hashEmail(email);
+
+    QWriteLocker locker(&lock);
+
+    if(!header) return;
+
+    seen.remove(hash);
+    tableRemove(hash);
+}
+
+bool SuppressionCache::sweep()
+{
+    QWriteLocker locker(&lock);
+
+    if(!header) return true;
+
+    Header kept = *header;
+
+    quint64 capacity = InitialCapacity;
+    while(quint64(seen.size()) * 10 > capacity * 7) capacity <<= 1;
+
+    if(!map(capacity, true)) return false;
+
+    std::memcpy(header->lastSync, kept.lastSync, sizeof(kept.lastSync));
+    header->lastFullSync = syncStart;
+
+    for(quint64 hash : qAsConst(seen)) tableInsert(hash);
+
+    return true;
+}
+
+void SuppressionCache::sync()
+{
+    if(!isOpen() || syncing) return;
+
+    syncing = true;
+    listsPending = ListCount;
+    added = 0;
+    syncStart = QDateTime::currentSecsSinceEpoch();
+
+    qint64 lastSync[ListCount];
+    {
+        QWriteLocker locker(&lock);
+
+        fullSync = fullSyncInterval > 0 && syncStart - header->lastFullSync >= fullSyncInterval;
+        fullSyncFailed = false;
+        seen.clear();
+
+        for(int list = 0; list < ListCount; list++) lastSync[list] = fullSync ? 0 : header->lastSync[list];
+    }
+
+    for(int list = 0; list < ListCount; list++)
+        fetch(list, lastSync[list], 0);
+}
+
+void SuppressionCache::fetch(int list, qint64 startTime, int offset)
+{
+    QHash<QString, QString> query {
+        {"limit", QString::number(PageSize)},
+        {"offset", QString::number(offset)}
+    };
+
+    if(startTime > 0) query.insert("start_time", QString::number(startTime));
+
+    consumer->get(Lists[list], [this, list, startTime, offset](const Gurra::RestResponse &response){
+
+        if(!response.isSuccess())
+        {
+            // this list keeps its position and is fetched from there next time,
+            // a full sync missing a list can't tell what was removed from it
+            fullSyncFailed = fullSyncFailed || fullSync;
+
+            emit error(response.error.isEmpty() ? response.data : response.error);
+            listDone(list);
+            return;
+        }
+
+        QJsonArray entries = QJsonDocument::fromJson(response.data).array();
+
+        for(const QJsonValue &entry : entries)
+            insert(entry.toObject().value("email").toString());
+
+        if(entries.size() == PageSize) {
+            fetch(list, startTime, offset + PageSize);
+            return;
+        }
+
+        // a little overlap with the next sync, inserting twice is harmless
+        {
+            QWriteLocker locker(&lock);
+            if(header) header->lastSync[list] = syncStart - 60;
+        }
+
+        listDone(list);
+
+    }, query);
+}
+
+void SuppressionCache::listDone(int list)
+{
+    Q_UNUSED(list)
+
+    if(--listsPending > 0) return;
+
+    bool swept = !fullSync || fullSyncFailed || sweep();
+
+    {
+        QWriteLocker locker(&lock);
+        fullSync = false;
+        seen.clear();
+    }
+
+    syncing = false;
+
+    if(!swept) emit error("SuppressionCache: couldn't rebuild storage");
+    emit synced(added);
+}
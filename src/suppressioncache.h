@@ -0,0 +1,112 @@
+#ifndef SUPPRESSIONCACHE_H
+#define SUPPRESSIONCACHE_H
+
+#include "sendgrid/restconsumer.h"
+#include "sendgrid/sendgrid.h"
+
+#include <QObject>
+#include <QFile>
+#include <QVector>
+#include <QSet>
+#include <QReadWriteLock>
+
+namespace SendGrid {
+
+// local copy of the bounces, blocks, spam reports and global unsubscribes of an
+// account, used to drop recipients SendGrid would drop anyway. addresses are kept
+// as 64 bit hashes in an open addressing table memory mapped from storage, with
+// a Bloom filter in front so the common case, an address that is not suppressed,
+// never touches the table. sync() only fetches what was added since the last one,
+// SendGrid doesn't list removals, so now and then a sync fetches everything and
+// drops the addresses no longer suppressed. the file is a cache, if it is lost or
+// damaged it is rebuilt by syncing again. lookups are safe from any thread
+class SuppressionCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    SuppressionCache(Gurra::RestConsumer *consumer, QString storage, QObject *parent = nullptr);
+    ~SuppressionCache();
+
+    bool isOpen();
+
+    bool contains(const QString &email);
+    void insert(const QString &email);
+
+    // an address taken off the lists, e.g. by a DELETE to /suppression/...
+    void remove(const QString &email);
+
+    int count();
+
+    // seconds between syncs that fetch every list from the start, a day by default.
+    // 0 only ever fetches additions
+    void setFullSyncInterval(int seconds);
+
+    // drops every address and the sync positions, the next sync fetches everything
+    void clear();
+
+public slots:
+    void sync();
+
+signals:
+    void synced(int added);
+    void error(const QByteArray err);
+
+private:
+    static const int ListCount = 4;
+    static const int PageSize = 500;
+
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        quint64 capacity;
+        quint64 count;
+        qint64 lastSync[ListCount];
+        qint64 lastFullSync;
+    };
+
+    static quint64 hashEmail(const QString &email);
+
+    bool open();
+    bool map(quint64 capacity, bool reset);
+    void grow();
+
+    bool tableContains(quint64 hash);
+    void tableInsert(quint64 hash);
+    void tableRemove(quint64 hash);
+    bool sweep();
+
+    void bloomReset();
+    void bloomInsert(quint64 hash);
+    bool bloomContains(quint64 hash);
+
+    void fetch(int list, qint64 startTime, int offset);
+    void listDone(int list);
+
+    Gurra::RestConsumer *consumer;
+
+    // taken for writing by everything that changes the table or the filter
+    QReadWriteLock lock;
+
+    QFile file;
+    Header *header = nullptr;
+    quint64 *slots = nullptr;
+
+    QVector<quint64> bloom;
+    quint64 bloomMask = 0;
+
+    bool syncing = false;
+    int listsPending = 0;
+    int added = 0;
+    qint64 syncStart = 0;
+
+    // a full sync collects every address it sees, those not seen are swept at the end
+    int fullSyncInterval = 24 * 3600;
+    bool fullSync = false;
+    bool fullSyncFailed = false;
+    QSet<quint64> seen;
+};
+
+}
+#endif // SUPPRESSIONCACHE_H
@@ -0,0 +1,350 @@
+#include "templateregistry.h"
+
+#include <QUrlQuery>
+#include <QVector>
+
+using namespace SendGrid;
+
+TemplateRegistry::TemplateRegistry(Gurra::RestConsumer *consumer, QObject *parent):
+    QObject(parent),
+    consumer {consumer}
+{
+    connect(&timer, &QTimer::timeout, this, &TemplateRegistry::refresh);
+}
+
+void TemplateRegistry::setRefreshInterval(int seconds)
+{
+    if(seconds > 0) timer.start(seconds * 1000);
+    else timer.stop();
+}
+
+bool TemplateRegistry::isLoaded()
+{
+    QReadLocker locker(&lock);
+    return m_generation > 0;
+}
+
+quint64 TemplateRegistry::generation()
+{
+    QReadLocker locker(&lock);
+    return m_generation;
+}
+
+bool TemplateRegistry::contains(const QString &templateId)
+{
+    QReadLocker locker(&lock);
+    return templates.contains(templateId);
+}
+
+TemplateInfo TemplateRegistry::value(const QString &templateId)
+{
+    QReadLocker locker(&lock);
+    return templates.value(templateId);
+}
+
+QStringList TemplateRegistry::missingKeys(const QString &templateId, const QJsonObject &dynamicTemplateData)
+{
+    return missing(value(templateId).keys, dynamicTemplateData);
+}
+
+QStringList TemplateRegistry::missing(const QSet<QString> &keys, const QJsonObject &dynamicTemplateData)
+{
+    QStringList missing;
+
+    for(const QString &key : keys)
+        if(!dynamicTemplateData.contains(key)) missing.append(key);
+
+    return missing;
+}
+
+QByteArray TemplateRegistry::check(SendGridMessage &msg)
+{
+    QString templateId = msg.getTemplateId();
+
+    if(templateId.isEmpty() || !isLoaded()) return QByteArray();
+
+    // a copy, the keys stay valid if a refresh swaps while checking
+    QReadLocker locker(&lock);
+
+    auto it = templates.constFind(templateId);
+
+    if(it == templates.constEnd()) return "unknown template " + templateId.toUtf8();
+
+    bool dynamic = it.value().dynamic;
+    QSet<QString> keys = it.value().keys;
+    locker.unlock();
+
+    if(!dynamic || keys.isEmpty()) return QByteArray();
+
+    for(const Personalization &p : msg.getPersonalizations())
+    {
+        QStringList missing = TemplateRegistry::missing(keys, p.dynamicTemplateData);
+
+        if(!missing.isEmpty()) {
+            QString to = p.to.isEmpty() ? QString() : p.to.first().email;
+            return "template " + templateId.toUtf8() + " needs " + missing.join(", ").toUtf8() + " for " + to.toUtf8();
+        }
+    }
+
+    return QByteArray();
+}
+
+// variables of a handlebars body that must be passed in. helpers, literals and
+// block keywords are left out, and so is anything inside each and with blocks
+// since it refers to the items rather than the data passed in. if, unless and
+// inverse blocks exist for data that may be missing, so their arguments and what
+// is used only inside them are optional
+QSet<QString> TemplateRegistry::templateKeys(const QString &text)
+{
+    enum BlockKind { OtherBlock, ScopeBlock, ConditionalBlock };
+
+    struct Block
+    {
+        QString name;
+        BlockKind kind;
+    };
+
+    QSet<QString> keys;
+    QVector<Block> blocks;
+    int scoped = 0;
+    int conditional = 0;
+    int from = 0;
+
+    forever
+    {
+        int open = text.indexOf("{{", from);
+        if(open < 0) break;
+
+        int close = text.indexOf("}}", open + 2);
+        if(close < 0) break;
+
+        from = close + 2;
+
+        QString inner = text.mid(open + 2, close - open - 2);
+
+        // {{{raw}}} and whitespace control {{~x~}}
+        while(inner.startsWith('{') || inner.startsWith('~')) inner.remove(0, 1);
+        while(inner.endsWith('}') || inner.endsWith('~')) inner.chop(1);
+
+        inner = inner.trimmed();
+
+        if(inner.isEmpty() || inner.startsWith('!') || inner.startsWith('>')) continue;
+
+        QStringList tokens = inner.split(' ', Qt::SkipEmptyParts);
+        QString head = tokens.first();
+
+        // {{else}}, {{else if x}} and {{^}} belong to the block around them
+        if(head == "else" || head == "^") continue;
+
+        // closes the innermost open block of that name, and whatever was left open inside it
+        if(head.startsWith('/'))
+        {
+            QString name = head.mid(1);
+            int i = blocks.size() - 1;
+
+            while(i >= 0 && blocks.at(i).name != name) i--;
+
+            for(; i >= 0 && blocks.size() > i; blocks.removeLast())
+            {
+                if(blocks.last().kind == ScopeBlock) scoped--;
+                if(blocks.last().kind == ConditionalBlock) conditional--;
+            }
+
+            continue;
+        }
+
+        bool block = head.startsWith('#') || head.startsWith('^');
+        bool helper = block || tokens.size() > 1;
+
+        BlockKind kind = OtherBlock;
+
+        if(head == "#each" || head == "#with") kind = ScopeBlock;
+        else if(head == "#if" || head == "#unless" || head.startsWith('^')) kind = ConditionalBlock;
+
+        // block and helper names aren't variables, their arguments are. a
+        // condition's arguments are what may be missing
+        QStringList candidates = helper ? tokens.mid(1) : tokens;
+
+        if(!scoped && !conditional && kind != ConditionalBlock)
+        {
+            for(QString token : candidates)
+            {
+                if(token.contains('=') || token.startsWith('"') || token.startsWith('\'') || token.startsWith('(')
+                        || token.startsWith('@') || token.startsWith("..") || token == "else" || token == "this"
+                        || token == "true" || token == "false" || token.at(0).isDigit() || token.at(0) == '-') continue;
+
+                // the root of a path, user of user.name or items[0]
+                int end = 0;
+                while(end < token.size() && token.at(end) != '.' && token.at(end) != '[' && token.at(end) != ')') end++;
+
+                token.truncate(end);
+
+                if(!token.isEmpty()) keys.insert(token);
+            }
+        }
+
+        if(block)
+        {
+            blocks.append({head.mid(1), kind});
+
+            if(kind == ScopeBlock) scoped++;
+            if(kind == ConditionalBlock) conditional++;
+        }
+    }
+
+    return keys;
+}
+
+void TemplateRegistry::refresh()
+{
+    if(refreshing) return;
+
+    refreshing = true;
+    failed = false;
+    listed = false;
+    pendingVersions = 0;
+    next.clear();
+
+    fetchPage({
+        {"generations", "legacy,dynamic"},
+        {"page_size", "200"}
+    });
+}
+
+void TemplateRegistry::fetchPage(QHash<QString, QString> query)
+{
+    consumer->get("/templates", [this](const Gurra::RestResponse &response){
+
+        if(!response.isSuccess())
+        {
+            emit error("TemplateRegistry: couldn't list templates " + (response.error.isEmpty() ? response.data : response.error));
+            failed = true;
+            listed = true;
+            finishRefresh();
+            return;
+        }
+
+        QJsonObject obj = QJsonDocument::fromJson(response.data).object();
+        QJsonArray list = obj.contains("result") ? obj.value("result").toArray() : obj.value("templates").toArray();
+
+        for(const QJsonValue &value : list)
+        {
+            QJsonObject item = value.toObject();
+
+            TemplateInfo info;
+            info.id = item.value("id").toString();
+            info.name = item.value("name").toString();
+            info.dynamic = item.value("generation").toString() == "dynamic";
+
+            QString updatedAt;
+
+            for(const QJsonValue &version : item.value("versions").toArray())
+            {
+                QJsonObject v = version.toObject();
+
+                if(v.value("active").toInt() == 1) {
+                    info.versionId = v.value("id").toString();
+                    updatedAt = v.value("updated_at").toString();
+                }
+            }
+
+            // a version already held is kept as it is, only changes are fetched
+            TemplateInfo held = templates.value(info.id);
+
+            if(!info.versionId.isEmpty() && (held.versionId != info.versionId || held.updatedAt != updatedAt))
+            {
+                next.insert(info.id, info);
+                fetchVersion(info.id, info.versionId);
+            }
+            else
+            {
+                held.id = info.id;
+                held.name = info.name;
+                held.dynamic = info.dynamic;
+                next.insert(info.id, held);
+            }
+        }
+
+        // dynamic templates are paged, the next page is given as a url
+        QString nextPage = obj.value("_metadata").toObject().value("next").toString();
+
+        if(!nextPage.isEmpty())
+        {
+            QHash<QString, QString> nextQuery;
+
+            for(const auto &item : QUrlQuery(QUrl(nextPage)).queryItems(QUrl::FullyDecoded))
+                nextQuery.insert(item.first, item.second);
+
+            fetchPage(nextQuery);
+            return;
+        }
+
+        listed = true;
+        finishRefresh();
+
+    }, query);
+}
+
+void TemplateRegistry::fetchVersion(const QString &templateId, const QString &versionId)
+{
+    pendingVersions++;
+
+    QByteArray resource = "/templates/" + templateId.toUtf8() + "/versions/" + versionId.toUtf8();
+
+    consumer->get(resource, [this, templateId](const Gurra::RestResponse &response){
+
+        pendingVersions--;
+
+        if(!response.isSuccess())
+        {
+            emit error("TemplateRegistry: couldn't fetch template " + templateId.toUtf8());
+            failed = true;
+            finishRefresh();
+            return;
+        }
+
+        QJsonObject v = QJsonDocument::fromJson(response.data).object();
+        TemplateInfo &info = next[templateId];
+
+        info.updatedAt = v.value("updated_at").toString();
+        info.subject = v.value("subject").toString();
+        info.htmlContent = v.value("html_content").toString();
+        info.plainContent = v.value("plain_content").toString();
+
+        info.keys.clear();
+
+        if(info.dynamic)
+        {
+            info.keys += templateKeys(info.subject);
+            info.keys += templateKeys(info.htmlContent);
+            info.keys += templateKeys(info.plainContent);
+        }
+
+        finishRefresh();
+    });
+}
+
+void TemplateRegistry::finishRefresh()
+{
+    if(!listed || pendingVersions > 0) return;
+
+    refreshing = false;
+
+    // a partial refresh is dropped, lookups keep the last complete one
+    if(failed) {
+        next.clear();
+        return;
+    }
+
+    quint64 generation;
+
+    {
+        QWriteLocker locker(&lock);
+        templates.swap(next);
+        generation = ++m_generation;
+    }
+
+    next.clear();
+
+    emit refreshed(generation);
+}
@@ -0,0 +1,96 @@
+#ifndef TEMPLATEREGISTRY_H
+#define TEMPLATEREGISTRY_H
+
+#include "sendgrid/restconsumer.h"
+#include "sendgrid/sendgridmessage.h"
+
+#include <QObject>
+#include <QTimer>
+#include <QSet>
+#include <QReadWriteLock>
+
+namespace SendGrid {
+
+// the active version of a transactional template
+struct TemplateInfo
+{
+    QString id;
+    QString name;
+    bool dynamic = false;
+
+    QString versionId;
+    QString updatedAt;
+    QString subject;
+    QString htmlContent;
+    QString plainContent;
+
+    // variables a dynamic template needs outside its conditionals, legacy templates have none
+    // since their substitution tags can't be told apart from text
+    QSet<QString> keys;
+};
+
+// local copy of the account's templates. refresh() lists /templates and fetches
+// the active versions that changed since the last refresh, all at once, then
+// swaps the new set in whole, so lookups never see a refresh half done and never
+// wait for the network. every swap bumps generation(). lookups are safe from any
+// thread
+class TemplateRegistry : public QObject
+{
+    Q_OBJECT
+
+public:
+    TemplateRegistry(Gurra::RestConsumer *consumer, QObject *parent = nullptr);
+
+    // refreshes every interval seconds in the background, 0 stops it
+    void setRefreshInterval(int seconds);
+
+    // whether a refresh has completed, until then nothing can be checked
+    bool isLoaded();
+    quint64 generation();
+
+    bool contains(const QString &templateId);
+    TemplateInfo value(const QString &templateId);
+
+    // keys a dynamic template needs that dynamicTemplateData doesn't have
+    QStringList missingKeys(const QString &templateId, const QJsonObject &dynamicTemplateData);
+
+    // checks that the template msg uses exists, and for a dynamic template that
+    // the dynamic_template_data of every personalization has the keys it needs.
+    // legacy templates are only checked to exist. returns why not, empty if fine
+    QByteArray check(SendGridMessage &msg);
+
+    static QSet<QString> templateKeys(const QString &text);
+
+public slots:
+    void refresh();
+
+signals:
+    void refreshed(quint64 generation);
+    void error(const QByteArray err);
+
+private:
+    void fetchPage(QHash<QString, QString> query);
+    void fetchVersion(const QString &templateId, const QString &versionId);
+    void finishRefresh();
+
+    static QStringList missing(const QSet<QString> &keys, const QJsonObject &dynamicTemplateData);
+
+    Gurra::RestConsumer *consumer;
+    QTimer timer;
+
+    // guards templates and m_generation, written only by the swap
+    QReadWriteLock lock;
+
+    QHash<QString, TemplateInfo> templates;
+    quint64 m_generation = 0;
+
+    // the refresh under way
+    bool refreshing = false;
+    bool failed = false;
+    int pendingVersions = 0;
+    bool listed = false;
+    QHash<QString, TemplateInfo> next;
+};
+
+}
+#endif // TEMPLATEREGISTRY_H
@@ -0,0 +1,298 @@
+#include "templaterenderer.h"
+#include "sendgrid.h"
+
+#include <QtAlgorithms>
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace SendGrid;
+
+TemplateRenderer::TemplateRenderer(const QString &body, const QStringList &tags):
+    body {body}
+{
+    addTags(tags);
+    compile();
+}
+
+TemplateRenderer::TemplateRenderer(const QByteArray &body, const QStringList &tags):
+    utf8Body {body},
+    utf8 {true}
+{
+    addTags(tags);
+    compile();
+}
+
+void TemplateRenderer::addTags(const QStringList &tags)
+{
+    for(const QString &tag : tags)
+    {
+        if(tag.isEmpty() || this->tags.contains(tag)) continue;
+
+        QByteArray utf8Tag = tag.toUtf8();
+        ushort first = utf8 ? uchar(utf8Tag.at(0)) : tag.at(0).unicode();
+        int slot = firsts.indexOf(first);
+
+        if(slot < 0) {
+            slot = firsts.size();
+            firsts.append(first);
+            tagsByFirst.append(QVector<int>());
+        }
+
+        tagsByFirst[slot].append(this->tags.size());
+        this->tags.append(tag);
+        utf8Tags.append(utf8Tag);
+    }
+
+    for(QVector<int> &group : tagsByFirst)
+    {
+        std::sort(group.begin(), group.end(), [this](int a, int b){
+            return tagSize(a) > tagSize(b);
+        });
+    }
+}
+
+void TemplateRenderer::compile()
+{
+    int literal = 0;
+    int position = findCandidate(0);
+
+    auto addLiteral = [this](int offset, int length){
+        if(length <= 0) return;
+
+        int jsonOffset = jsonLiterals.size();
+
+        if(utf8) appendJsonEscaped(jsonLiterals, utf8Body.constData() + offset, length);
+        else appendJsonEscaped(jsonLiterals, body.mid(offset, length));
+
+        segments.append(Segment {offset, length, -1, jsonOffset, jsonLiterals.size() - jsonOffset});
+    };
+
+    while(position >= 0)
+    {
+        int tag = matchTag(position);
+
+        if(tag < 0) {
+            position = findCandidate(position + 1);
+            continue;
+        }
+
+        addLiteral(literal, position - literal);
+        segments.append(Segment {position, tagSize(tag), tag, 0, 0});
+
+        literal = position + tagSize(tag);
+        position = findCandidate(literal);
+    }
+
+    addLiteral(literal, bodySize() - literal);
+}
+
+int TemplateRenderer::bodySize() const
+{
+    return utf8 ? utf8Body.size() : body.size();
+}
+
+int TemplateRenderer::tagSize(int tag) const
+{
+    return utf8 ? utf8Tags.at(tag).size() : tags.at(tag).size();
+}
+
+int TemplateRenderer::tagCount() const
+{
+    return tags.size();
+}
+
+int TemplateRenderer::findCandidate(int from) const
+{
+    if(firsts.isEmpty()) return -1;
+    if(utf8) return findCandidateUtf8(from);
+
+    const ushort *data = reinterpret_cast<const ushort *>(body.constData());
+    const int size = body.size();
+    int i = from;
+
+#ifdef __SSE2__
+    // compare 8 characters at a time against every first character
+    if(firsts.size() <= 8)
+    {
+        __m128i needles[8];
+        const int count = firsts.size();
+
+        for(int n = 0; n < count; n++) needles[n] = _mm_set1_epi16(short(firsts.at(n)));
+
+        for(; i + 8 <= size; i += 8)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i hits = _mm_cmpeq_epi16(chunk, needles[0]);
+
+            for(int n = 1; n < count; n++) hits = _mm_or_si128(hits, _mm_cmpeq_epi16(chunk, needles[n]));
+
+            int mask = _mm_movemask_epi8(hits);
+
+            // two mask bits per character
+            if(mask) return i + (qCountTrailingZeroBits(quint32(mask)) >> 1);
+        }
+    }
+#endif
+
+    for(; i < size; i++)
+        if(firsts.contains(data[i])) return i;
+
+    return -1;
+}
+
+int TemplateRenderer::matchTag(int position) const
+{
+    if(utf8) return matchTagUtf8(position);
+
+    const QChar *data = body.constData() + position;
+    const int left = body.size() - position;
+
+    int slot = firsts.indexOf(data->unicode());
+    if(slot < 0) return -1;
+
+    for(int tag : tagsByFirst.at(slot))
+    {
+        const QString &t = tags.at(tag);
+
+        if(t.size() <= left && std::memcmp(data, t.constData(), size_t(t.size()) * sizeof(QChar)) == 0)
+            return tag;
+    }
+
+    return -1;
+}
+
+int TemplateRenderer::findCandidateUtf8(int from) const
+{
+    const char *data = utf8Body.constData();
+    const int size = utf8Body.size();
+    int i = from;
+
+#ifdef __SSE2__
+    // compare 16 bytes at a time against every first byte
+    if(firsts.size() <= 8)
+    {
+        __m128i needles[8];
+        const int count = firsts.size();
+
+        for(int n = 0; n < count; n++) needles[n] = _mm_set1_epi8(char(firsts.at(n)));
+
+        for(; i + 16 <= size; i += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i hits = _mm_cmpeq_epi8(chunk, needles[0]);
+
+            for(int n = 1; n < count; n++) hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[n]));
+
+            int mask = _mm_movemask_epi8(hits);
+
+            if(mask) return i + qCountTrailingZeroBits(quint32(mask));
+        }
+    }
+#endif
+
+    for(; i < size; i++)
+        if(firsts.contains(uchar(data[i]))) return i;
+
+    return -1;
+}
+
+// a tag starts with a lead byte, which never occurs inside another character,
+// so byte matches are character matches
+int TemplateRenderer::matchTagUtf8(int position) const
+{
+    const char *data = utf8Body.constData() + position;
+    const int left = utf8Body.size() - position;
+
+    int slot = firsts.indexOf(uchar(*data));
+    if(slot < 0) return -1;
+
+    for(int tag : tagsByFirst.at(slot))
+    {
+        const QByteArray &t = utf8Tags.at(tag);
+
+        if(t.size() <= left && std::memcmp(data, t.constData(), size_t(t.size())) == 0)
+            return tag;
+    }
+
+    return -1;
+}
+
+QString TemplateRenderer::render(const QHash<QString, QString> &substitutions) const
+{
+    // one lookup per tag, not per occurrence, missing tags are left as they are
+    QVector<QString> values(tags.size());
+    QVector<bool> found(tags.size(), false);
+
+    for(int i = 0; i < tags.size(); i++)
+    {
+        auto it = substitutions.constFind(tags.at(i));
+        if(it != substitutions.constEnd()) {
+            values[i] = it.value();
+            found[i] = true;
+        }
+    }
+
+    if(utf8)
+    {
+        QByteArray out;
+
+        for(const Segment &segment : segments)
+        {
+            if(segment.tag >= 0 && found.at(segment.tag)) out += values.at(segment.tag).toUtf8();
+            else out.append(utf8Body.constData() + segment.offset, segment.length);
+        }
+
+        return QString::fromUtf8(out);
+    }
+
+    int size = 0;
+
+    for(const Segment &segment : segments)
+        size += segment.tag >= 0 && found.at(segment.tag) ? values.at(segment.tag).size() : segment.length;
+
+    QString out(size, Qt::Uninitialized);
+    QChar *dst = out.data();
+
+    for(const Segment &segment : segments)
+    {
+        const QChar *src = body.constData() + segment.offset;
+        int length = segment.length;
+
+        if(segment.tag >= 0 && found.at(segment.tag)) {
+            src = values.at(segment.tag).constData();
+            length = values.at(segment.tag).size();
+        }
+
+        std::memcpy(dst, src, size_t(length) * sizeof(QChar));
+        dst += length;
+    }
+
+    return out;
+}
+
+void TemplateRenderer::renderJson(const QHash<QString, QString> &substitutions, QByteArray &out) const
+{
+    // values are escaped once per render, unmatched tags keep their own text
+    QVector<QByteArray> values(tags.size());
+
+    for(int i = 0; i < tags.size(); i++)
+        appendJsonEscaped(values[i], substitutions.value(tags.at(i), tags.at(i)));
+
+    int size = 0;
+
+    for(const Segment &segment : segments)
+        size += segment.tag >= 0 ? values.at(segment.tag).size() : segment.jsonLength;
+
+    out.reserve(out.size() + size);
+
+    for(const Segment &segment : segments)
+    {
+        if(segment.tag >= 0) out.append(values.at(segment.tag));
+        else out.append(jsonLiterals.constData() + segment.jsonOffset, segment.jsonLength);
+    }
+}
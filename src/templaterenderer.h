@@ -0,0 +1,75 @@
+#ifndef TEMPLATERENDERER_H
+#define TEMPLATERENDERER_H
+
+#include <QString>
+#include <QByteArrayList>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+
+namespace SendGrid {
+
+// a body compiled once into literal runs and substitution tag slots, so every
+// recipient is rendered in a single pass without searching the body again
+class TemplateRenderer
+{
+public:
+    TemplateRenderer(){}
+
+    // tags are the substitution keys that may occur in body, the longest wins
+    // when several of them match at the same position
+    TemplateRenderer(const QString &body, const QStringList &tags);
+
+    // a UTF-8 body is scanned and escaped as bytes, it is never converted
+    TemplateRenderer(const QByteArray &body, const QStringList &tags);
+
+    QString render(const QHash<QString, QString> &substitutions) const;
+
+    // appends the rendered body to out JSON escaped, without quotes
+    void renderJson(const QHash<QString, QString> &substitutions, QByteArray &out) const;
+
+    int tagCount() const;
+
+private:
+    struct Segment
+    {
+        // offset and length in body, or the index in tags for a tag slot
+        int offset;
+        int length;
+        int tag;
+
+        // the literal run pre-escaped in jsonLiterals
+        int jsonOffset;
+        int jsonLength;
+    };
+
+    void addTags(const QStringList &tags);
+    void compile();
+
+    int bodySize() const;
+    int tagSize(int tag) const;
+
+    int findCandidate(int from) const;
+    int matchTag(int position) const;
+    int findCandidateUtf8(int from) const;
+    int matchTagUtf8(int position) const;
+
+    // one of the two bodies is used, offsets count characters or bytes accordingly
+    QString body;
+    QByteArray utf8Body;
+    bool utf8 = false;
+
+    QStringList tags;
+    QByteArrayList utf8Tags;
+    QVector<Segment> segments;
+    QByteArray jsonLiterals;
+
+    // distinct first characters of the tags, or first bytes, what the scan looks for
+    QVector<ushort> firsts;
+
+    // tags starting with each of firsts, longest first
+    QVector<QVector<int>> tagsByFirst;
+};
+
+}
+#endif // TEMPLATERENDERER_H
@@ -0,0 +1,104 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <QVector>
+
+namespace Gurra {
+
+// hierarchical timing wheel, every level has 64 slots and each slot of a level
+// spans a whole turn of the level below it. entries are only cascaded down when
+// their slot comes up, so insert and expiry are O(1) no matter how far ahead
+// the expiry is. time is counted in abstract ticks chosen by the owner.
+template<typename T> class TimingWheel
+{
+public:
+    TimingWheel(qint64 now = 0): current {now} {}
+
+    void insert(qint64 expiry, T value)
+    {
+        place({expiry, value}, current + 1);
+        m_count++;
+    }
+
+    // moves the wheel forward to now, passing every expired value to fire
+    template<typename F> void advance(qint64 now, F fire)
+    {
+        while(current < now)
+        {
+            current++;
+
+            // cascade the levels whose turn just completed, highest first,
+            // so lower slots receive everything before they are cascaded
+            int top = 0;
+            while(top + 1 < Levels && (current & ((qint64(1) << (SlotBits * (top + 1))) - 1)) == 0) top++;
+
+            for(int level = top; level > 0; level--)
+            {
+                QVector<Entry> entries;
+                entries.swap(wheel[level][(current >> (SlotBits * level)) & SlotMask]);
+
+                for(const Entry &entry : entries) place(entry, current);
+            }
+
+            QVector<Entry> due;
+            due.swap(wheel[0][current & SlotMask]);
+
+            for(const Entry &entry : due) {
+                m_count--;
+                fire(entry.value);
+            }
+        }
+    }
+
+    // catches an empty wheel up to now in one step, advance() would walk every
+    // tick in between. a wheel holding entries is left alone
+    void reset(qint64 now)
+    {
+        if(m_count == 0 && now > current) current = now;
+    }
+
+    qint64 now() const { return current; }
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+private:
+    static const int SlotBits = 6;
+    static const int Slots = 1 << SlotBits;
+    static const int SlotMask = Slots - 1;
+    static const int Levels = 5;
+
+    struct Entry
+    {
+        qint64 expiry;
+        T value;
+    };
+
+    // earliest is the first tick whose slot has not been processed yet
+    void place(const Entry &entry, qint64 earliest)
+    {
+        qint64 expiry = entry.expiry > earliest ? entry.expiry : earliest;
+        qint64 delta = expiry - current;
+
+        for(int level = 0; level < Levels; level++)
+        {
+            if(delta < (qint64(1) << (SlotBits * (level + 1))))
+            {
+                wheel[level][(expiry >> (SlotBits * level)) & SlotMask].append(entry);
+                return;
+            }
+        }
+
+        // beyond the range of the wheel, park it in the top level slot that
+        // comes up last, it is placed again with its real expiry from there
+        qint64 last = current + (qint64(1) << (SlotBits * Levels)) - 1;
+        wheel[Levels - 1][(last >> (SlotBits * (Levels - 1))) & SlotMask].append(entry);
+    }
+
+    QVector<Entry> wheel[Levels][Slots];
+    qint64 current;
+    int m_count = 0;
+};
+
+}
+
+#endif // TIMINGWHEEL_H
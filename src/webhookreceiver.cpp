@@ -0,0 +1,479 @@
+#include "webhookreceiver.h"
+#include "jsonscan.h"
+
+#include <QVarLengthArray>
+#include <QPair>
+
+using namespace SendGrid;
+using namespace SendGrid::JsonScan;
+
+WebhookReceiver::WebhookReceiver(Consumer consumer, QObject *parent):
+    QObject(parent),
+    consumer {consumer}
+{
+    connect(&server, &QTcpServer::newConnection, this, &WebhookReceiver::acceptConnections);
+}
+
+WebhookReceiver::~WebhookReceiver()
+{
+    close();
+}
+
+bool WebhookReceiver::listen(const QHostAddress &address, quint16 port)
+{
+    if(server.listen(address, port)) return true;
+
+    emit error(server.errorString().toUtf8());
+    return false;
+}
+
+quint16 WebhookReceiver::port(){
+    return server.serverPort();
+}
+
+void WebhookReceiver::close()
+{
+    server.close();
+
+    for(QTcpSocket *socket : connections.keys()) {
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+
+    connections.clear();
+}
+
+void WebhookReceiver::setEventTypes(int types){
+    eventTypes = types;
+}
+
+void WebhookReceiver::setFields(int fields){
+    this->fields = fields;
+}
+
+void WebhookReceiver::setCustomArgs(QStringList keys)
+{
+    customArgKeys.clear();
+
+    for(const QString &key : keys) customArgKeys.insert(key.toUtf8());
+}
+
+void WebhookReceiver::setPath(QByteArray path){
+    this->path = path;
+}
+
+qint64 WebhookReceiver::received(){
+    return m_received;
+}
+
+qint64 WebhookReceiver::malformed(){
+    return m_malformed;
+}
+
+void WebhookReceiver::acceptConnections()
+{
+    while(QTcpSocket *socket = server.nextPendingConnection())
+    {
+        connections.insert(socket, Connection());
+
+        connect(socket, &QTcpSocket::readyRead, this, &WebhookReceiver::readConnection);
+        connect(socket, &QTcpSocket::disconnected, this, &WebhookReceiver::dropConnection);
+    }
+}
+
+void WebhookReceiver::dropConnection()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+
+    connections.remove(socket);
+    socket->deleteLater();
+}
+
+void WebhookReceiver::respond(QTcpSocket *socket, QByteArray status)
+{
+    socket->write("HTTP/1.1 " + status + "\r\nContent-Length: 0\r\n\r\n");
+}
+
+void WebhookReceiver::fail(QTcpSocket *socket, QByteArray status, QByteArray reason)
+{
+    respond(socket, status);
+    emit error("WebhookReceiver: " + reason);
+
+    closeConnection(socket);
+}
+
+void WebhookReceiver::closeConnection(QTcpSocket *socket)
+{
+    connections.remove(socket);
+    socket->disconnect(this);
+    socket->disconnectFromHost();
+    socket->deleteLater();
+}
+
+void WebhookReceiver::readConnection()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    auto it = connections.find(socket);
+
+    if(it == connections.end()) return;
+
+    Connection &connection = it.value();
+    connection.buffer += socket->readAll();
+
+    QVector<WebhookEvent> events;
+
+    // several requests may be pipelined on one connection, an empty body
+    // still has to be answered
+    while(!connection.buffer.isEmpty() || (connection.state != Connection::Head && connection.remaining == 0))
+    {
+        if(connection.state == Connection::Head)
+        {
+            if(!parseHead(socket, connection)) break;
+            continue;
+        }
+
+        qint64 available = qMin<qint64>(connection.buffer.size(), connection.remaining);
+
+        if(!parseBody(connection, available, events)) {
+            if(!events.isEmpty()) consumer(events);
+            fail(socket, "400 Bad Request", "malformed event batch");
+            return;
+        }
+
+        // the rest of the body is in and the batch still isn't complete
+        bool complete = connection.remaining == 0;
+
+        if(!complete && connection.buffer.size() >= connection.remaining) {
+            if(!events.isEmpty()) consumer(events);
+            fail(socket, "400 Bad Request", "truncated event batch");
+            return;
+        }
+
+        if(!complete) break;
+
+        if(connection.state != Connection::AfterArray) {
+            if(!events.isEmpty()) consumer(events);
+            fail(socket, "400 Bad Request", "truncated event batch");
+            return;
+        }
+
+        // events are handed on before the batch is acknowledged, a batch that
+        // fails halfway is sent again by SendGrid so consumers should expect
+        // to see an sg_event_id more than once
+        if(!events.isEmpty()) {
+            consumer(events);
+            events.clear();
+        }
+
+        respond(socket, "200 OK");
+
+        connection.state = Connection::Head;
+
+        if(!connection.keepAlive) {
+            closeConnection(socket);
+            return;
+        }
+    }
+
+    if(!events.isEmpty()) consumer(events);
+}
+
+bool WebhookReceiver::parseHead(QTcpSocket *socket, Connection &connection)
+{
+    int headEnd = connection.buffer.indexOf("\r\n\r\n");
+
+    if(headEnd < 0)
+    {
+        if(connection.buffer.size() > MaxHeadSize) fail(socket, "431 Request Header Fields Too Large", "request head too large");
+        return false;
+    }
+
+    QList<QByteArray> lines = connection.buffer.left(headEnd).split('\n');
+    QList<QByteArray> request = lines.first().trimmed().split(' ');
+
+    if(request.size() != 3 || request.at(0) != "POST") {
+        fail(socket, "405 Method Not Allowed", "only POST is accepted");
+        return false;
+    }
+
+    QByteArray target = request.at(1);
+    int query = target.indexOf('?');
+    if(query >= 0) target.truncate(query);
+
+    if(!path.isEmpty() && target != path) {
+        fail(socket, "404 Not Found", "unexpected path " + target);
+        return false;
+    }
+
+    qint64 length = -1;
+    bool chunked = false;
+    bool expectContinue = false;
+
+    connection.keepAlive = request.at(2) != "HTTP/1.0";
+
+    for(int i = 1; i < lines.size(); i++)
+    {
+        const QByteArray &line = lines.at(i);
+        int colon = line.indexOf(':');
+
+        if(colon < 0) continue;
+
+        QByteArray name = line.left(colon).trimmed().toLower();
+        QByteArray value = line.mid(colon + 1).trimmed().toLower();
+
+        if(name == "content-length") length = value.toLongLong();
+        else if(name == "transfer-encoding") chunked = value != "identity";
+        else if(name == "expect") expectContinue = value == "100-continue";
+        else if(name == "connection") {
+            if(value == "close") connection.keepAlive = false;
+            else if(value == "keep-alive") connection.keepAlive = true;
+        }
+    }
+
+    if(chunked || length < 0) {
+        fail(socket, "411 Length Required", "request without a Content-Length");
+        return false;
+    }
+
+    if(expectContinue) socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+
+    connection.buffer.remove(0, headEnd + 4);
+    connection.remaining = length;
+    connection.state = Connection::BeforeArray;
+    connection.scanned = 0;
+    connection.depth = 0;
+    connection.inString = false;
+    connection.escape = false;
+
+    return true;
+}
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool WebhookReceiver::parseBody(Connection &connection, qint64 available, QVector<WebhookEvent> &events)
+{
+    const char *data = connection.buffer.constData();
+    const int limit = int(available);
+
+    // an event still open from the last read starts at the front of the buffer
+    int eventStart = 0;
+    int i = connection.state == Connection::InEvent ? connection.scanned : 0;
+
+    while(i < limit)
+    {
+        char c = data[i];
+
+        switch (connection.state) {
+        case Connection::BeforeArray:
+            if(c == '[') connection.state = Connection::BetweenEvents;
+            else if(!isSpace(c)) return false;
+            i++;
+            break;
+
+        case Connection::BetweenEvents:
+            if(c == '{') {
+                connection.state = Connection::InEvent;
+                connection.depth = 0;
+                connection.inString = false;
+                connection.escape = false;
+                eventStart = i;
+                break;
+            }
+
+            if(c == ']') connection.state = Connection::AfterArray;
+            else if(c != ',' && !isSpace(c)) return false;
+            i++;
+            break;
+
+        case Connection::InEvent:
+            // only the structure is tracked here, decodeEvent reads the contents
+            while(i < limit)
+            {
+                c = data[i++];
+
+                if(connection.inString)
+                {
+                    if(connection.escape) connection.escape = false;
+                    else if(c == '\\') connection.escape = true;
+                    else if(c == '"') connection.inString = false;
+                }
+                else if(c == '"') connection.inString = true;
+                else if(c == '{' || c == '[') connection.depth++;
+                else if((c == '}' || c == ']') && --connection.depth == 0)
+                {
+                    if(!decodeEvent(data + eventStart, data + i, events)) m_malformed++;
+
+                    connection.state = Connection::BetweenEvents;
+                    break;
+                }
+            }
+
+            if(connection.state == Connection::InEvent && i - eventStart > MaxEventSize) return false;
+            break;
+
+        case Connection::AfterArray:
+            if(!isSpace(c)) return false;
+            i++;
+            break;
+
+        default:
+            return false;
+        }
+    }
+
+    int consumed = connection.state == Connection::InEvent ? eventStart : limit;
+
+    if(connection.state == Connection::InEvent) connection.scanned = i - eventStart;
+
+    connection.buffer.remove(0, consumed);
+    connection.remaining -= consumed;
+
+    return true;
+}
+
+static WebhookEvent::Type eventType(const char *data, int size)
+{
+    static const struct { const char *name; WebhookEvent::Type type; } types[] = {
+        {"delivered", WebhookEvent::Delivered},
+        {"open", WebhookEvent::Open},
+        {"click", WebhookEvent::Click},
+        {"processed", WebhookEvent::Processed},
+        {"deferred", WebhookEvent::Deferred},
+        {"bounce", WebhookEvent::Bounce},
+        {"dropped", WebhookEvent::Dropped},
+        {"spamreport", WebhookEvent::SpamReport},
+        {"unsubscribe", WebhookEvent::Unsubscribe},
+        {"group_unsubscribe", WebhookEvent::GroupUnsubscribe},
+        {"group_resubscribe", WebhookEvent::GroupResubscribe}
+    };
+
+    for(const auto &type : types)
+        if(keyIs(data, size, type.name)) return type.type;
+
+    return WebhookEvent::UnknownEvent;
+}
+
+bool WebhookReceiver::decodeEvent(const char *p, const char *end, QVector<WebhookEvent> &events)
+{
+    // the raw values are located first, strings are only decoded once the
+    // event type is known to be wanted
+    struct Span
+    {
+        const char *data = nullptr;
+        int size = 0;
+        bool escaped = false;
+    };
+
+    enum Slot { TypeSlot, EmailSlot, TimestampSlot, EventIdSlot, MessageIdSlot, ReasonSlot, ResponseSlot,
+                StatusSlot, UrlSlot, IpSlot, UserAgentSlot, SlotCount };
+
+    static const struct { const char *key; Slot slot; int field; } keys[] = {
+        {"event", TypeSlot, 0},
+        {"email", EmailSlot, WebhookEvent::Email},
+        {"timestamp", TimestampSlot, WebhookEvent::Timestamp},
+        {"sg_event_id", EventIdSlot, WebhookEvent::EventId},
+        {"sg_message_id", MessageIdSlot, WebhookEvent::MessageId},
+        {"reason", ReasonSlot, WebhookEvent::Reason},
+        {"response", ResponseSlot, WebhookEvent::Reason},
+        {"status", StatusSlot, WebhookEvent::Status},
+        {"url", UrlSlot, WebhookEvent::Url},
+        {"ip", IpSlot, WebhookEvent::Ip},
+        {"useragent", UserAgentSlot, WebhookEvent::UserAgent}
+    };
+
+    Span spans[SlotCount];
+    QVarLengthArray<QPair<Span, Span>, 4> args;
+
+    p++; // '{'
+    skipSpace(p, end);
+
+    while(p < end && *p != '}')
+    {
+        Span key;
+        if(*p != '"' || !scanString(p, end, key.data, key.size, key.escaped)) return false;
+
+        skipSpace(p, end);
+        if(p >= end || *p != ':') return false;
+        p++;
+        skipSpace(p, end);
+
+        int slot = -1;
+
+        for(const auto &k : keys)
+        {
+            if(keyIs(key.data, key.size, k.key)) {
+                if(k.field == 0 || (fields & k.field)) slot = k.slot;
+                break;
+            }
+        }
+
+        bool arg = slot < 0 && !customArgKeys.isEmpty() && !key.escaped
+                && customArgKeys.contains(QByteArray::fromRawData(key.data, key.size));
+
+        if(slot >= 0 || arg)
+        {
+            Span value;
+
+            if(p < end && *p == '"') {
+                if(!scanString(p, end, value.data, value.size, value.escaped)) return false;
+            }
+            else {
+                // numbers and literals are taken as their text
+                value.data = p;
+                if(!skipValue(p, end)) return false;
+                value.size = int(p - value.data);
+            }
+
+            if(slot >= 0) spans[slot] = value;
+            else args.append(qMakePair(key, value));
+        }
+        else if(!skipValue(p, end)) return false;
+
+        skipSpace(p, end);
+        if(p < end && *p == ',') {
+            p++;
+            skipSpace(p, end);
+        }
+    }
+
+    WebhookEvent::Type type = eventType(spans[TypeSlot].data, spans[TypeSlot].size);
+
+    if(!(type & eventTypes)) return true;
+
+    WebhookEvent event;
+    event.type = type;
+
+    auto text = [&spans](Slot slot){
+        const Span &span = spans[slot];
+        return span.data ? decodeString(span.data, span.size, span.escaped) : QString();
+    };
+
+    auto bytes = [&spans](Slot slot){
+        const Span &span = spans[slot];
+        return span.data ? QByteArray(span.data, span.size) : QByteArray();
+    };
+
+    event.email = text(EmailSlot);
+    event.eventId = bytes(EventIdSlot);
+    event.messageId = bytes(MessageIdSlot);
+    event.reason = spans[ReasonSlot].data ? text(ReasonSlot) : text(ResponseSlot);
+    event.status = text(StatusSlot);
+    event.url = text(UrlSlot);
+    event.ip = text(IpSlot);
+    event.userAgent = text(UserAgentSlot);
+
+    if(spans[TimestampSlot].data)
+        event.timestamp = QByteArray::fromRawData(spans[TimestampSlot].data, spans[TimestampSlot].size).toLongLong();
+
+    for(const auto &arg : args)
+        event.customArgs.insert(decodeString(arg.first.data, arg.first.size, false), decodeString(arg.second.data, arg.second.size, arg.second.escaped));
+
+    events.append(event);
+    m_received++;
+
+    return true;
+}
@@ -0,0 +1,164 @@
+#ifndef WEBHOOKRECEIVER_H
+#define WEBHOOKRECEIVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QStringList>
+
+#include <functional>
+
+namespace SendGrid {
+
+// one entry of an Event Webhook batch, only the fields the receiver was told
+// to decode are filled in
+struct WebhookEvent
+{
+    enum Type
+    {
+        UnknownEvent = 0,
+        Processed = 1 << 0,
+        Dropped = 1 << 1,
+        Delivered = 1 << 2,
+        Deferred = 1 << 3,
+        Bounce = 1 << 4,
+        Open = 1 << 5,
+        Click = 1 << 6,
+        SpamReport = 1 << 7,
+        Unsubscribe = 1 << 8,
+        GroupUnsubscribe = 1 << 9,
+        GroupResubscribe = 1 << 10,
+        AllEvents = (1 << 11) - 1
+    };
+
+    enum Field
+    {
+        Email = 1 << 0,
+        Timestamp = 1 << 1,
+        EventId = 1 << 2,
+        MessageId = 1 << 3,
+        Reason = 1 << 4,
+        Status = 1 << 5,
+        Url = 1 << 6,
+        Ip = 1 << 7,
+        UserAgent = 1 << 8,
+        AllFields = (1 << 9) - 1
+    };
+
+    Type type = UnknownEvent;
+
+    QString email;
+    qint64 timestamp = 0;
+    QByteArray eventId;
+    QByteArray messageId;
+
+    // reason of a drop or bounce, or the response of a deferral
+    QString reason;
+    QString status;
+    QString url;
+    QString ip;
+    QString userAgent;
+
+    // custom args are delivered as top level keys, the ones asked for end up here
+    QHash<QString, QString> customArgs;
+};
+
+// receives Event Webhook POSTs. the body is parsed as it arrives, every event is
+// decoded on its own as soon as its closing brace is in, so memory is bounded by
+// the largest event rather than the batch. events of a type nobody subscribed to
+// are skipped without decoding any strings. the consumer is called with all the
+// events that were completed by a read from the socket
+class WebhookReceiver : public QObject
+{
+    Q_OBJECT
+
+public:
+    using Consumer = std::function<void(const QVector<WebhookEvent> &events)>;
+
+    WebhookReceiver(Consumer consumer, QObject *parent = nullptr);
+    ~WebhookReceiver();
+
+    bool listen(const QHostAddress &address = QHostAddress::Any, quint16 port = 0);
+    quint16 port();
+    void close();
+
+    // events of other types are skipped, a combination of WebhookEvent::Type
+    void setEventTypes(int types);
+
+    // fields decoded into the events, a combination of WebhookEvent::Field
+    void setFields(int fields);
+
+    // custom args copied into WebhookEvent::customArgs
+    void setCustomArgs(QStringList keys);
+
+    // only POSTs to path are accepted, empty accepts any
+    void setPath(QByteArray path);
+
+    // events handed to the consumer, and events that couldn't be decoded
+    qint64 received();
+    qint64 malformed();
+
+signals:
+    void error(const QByteArray err);
+
+private slots:
+    void acceptConnections();
+    void readConnection();
+    void dropConnection();
+
+private:
+    // largest request head and single event accepted
+    static const int MaxHeadSize = 16 * 1024;
+    static const int MaxEventSize = 1024 * 1024;
+
+    struct Connection
+    {
+        enum State
+        {
+            Head,
+            BeforeArray,
+            BetweenEvents,
+            InEvent,
+            AfterArray
+        };
+
+        QByteArray buffer;
+        State state = Head;
+
+        // body bytes not parsed yet
+        qint64 remaining = 0;
+        bool keepAlive = true;
+
+        // scanning position inside an event, kept across reads
+        int scanned = 0;
+        int depth = 0;
+        bool inString = false;
+        bool escape = false;
+    };
+
+    void fail(QTcpSocket *socket, QByteArray status, QByteArray reason);
+    void closeConnection(QTcpSocket *socket);
+    bool parseHead(QTcpSocket *socket, Connection &connection);
+    bool parseBody(Connection &connection, qint64 available, QVector<WebhookEvent> &events);
+    bool decodeEvent(const char *p, const char *end, QVector<WebhookEvent> &events);
+    void respond(QTcpSocket *socket, QByteArray status);
+
+    Consumer consumer;
+    QTcpServer server;
+
+    int eventTypes = WebhookEvent::AllEvents;
+    int fields = WebhookEvent::AllFields;
+    QSet<QByteArray> customArgKeys;
+    QByteArray path;
+
+    QHash<QTcpSocket *, Connection> connections;
+    qint64 m_received = 0;
+    qint64 m_malformed = 0;
+};
+
+}
+#endif // WEBHOOKRECEIVER_H